@@ -0,0 +1,597 @@
+/*******************************************************************************
+ * Name        : chatbench.c
+ * Author      : Marjan Chowdhury
+ * Description : Load generator and latency benchmark for the chat server
+ ******************************************************************************/
+#include <arpa/inet.h>
+#include <ctype.h>
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include "protocol.h"
+#include "tls.h"
+#include "util.h"
+
+// Max number of ready sockets handled per epoll_wait() call.
+#define MAX_EVENTS      256
+// Connections still being set up at once, so the server's listen backlog
+// does not overflow and stall the setup on SYN retransmits.
+#define MAX_PENDING     512
+// How long setup and the final drain may take, in seconds.
+#define SETUP_TIMEOUT   60
+#define DRAIN_TIMEOUT   5
+
+/**
+ * One simulated user. Frames that the socket would not take yet wait in out,
+ * and received bytes wait in in until they form whole frames.
+ */
+typedef struct bench_client {
+    int fd;
+    int room;
+    bool connected;
+    bool handshaking;       // TLS handshake not done yet
+    bool ready;             // welcomed and in its room
+    SSL *ssl;               // NULL for plain TCP
+    char *in;
+    size_t in_len, in_cap;
+    char *out;
+    size_t out_len, out_cap;
+    long sent;              // chat messages sent, for senders
+} bench_client;
+
+bench_client *clients = NULL;
+int num_clients = 100, num_senders = 1, num_rooms = 1, duration = 10;
+int msg_len = 32, epoll_fd = -1, num_ready = 0;
+double rate = 100;          // messages per second per sender
+long total_sent = 0, total_received = 0, expected = 0;
+// When the send phase started. The server replays a room's recent messages
+// to everyone who joins it, so chat frames stamped earlier are left over
+// from an earlier run, not deliveries of this one.
+uint64_t send_start = UINT64_MAX;
+
+// With -t, every connection uses TLS. The first session ticket received is
+// offered by every later connection, the way a client that reconnects
+// would, so the setup measures resumed handshakes.
+SSL_CTX *tls_ctx = NULL;
+SSL_SESSION *tls_session = NULL;
+const char *server_ip = NULL;
+int num_handshakes = 0, num_resumed = 0;
+
+// Delivery latencies in microseconds, sorted at the end for percentiles.
+uint32_t *latencies = NULL;
+size_t num_latencies = 0, latencies_cap = 0;
+
+void *xrealloc(void *ptr, size_t size) {
+    ptr = realloc(ptr, size);
+    if (ptr == NULL) {
+        fprintf(stderr, "Error: realloc() failed. %s.\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    return ptr;
+}
+
+uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * Reports a lost connection. A benchmark with fewer clients than asked for
+ * would measure the wrong thing, so it stops here.
+ */
+void connection_lost(bench_client *c, const char *what) {
+    fprintf(stderr, "Error: Connection %d %s. %s.\n", (int)(c - clients),
+            what, errno == 0 ? "Closed by server" : strerror(errno));
+    exit(EXIT_FAILURE);
+}
+
+/**
+ * Sends as much of c's pending output as the socket takes.
+ */
+void flush_client(bench_client *c) {
+    size_t sent = 0;
+    while (sent < c->out_len) {
+        ssize_t n = c->ssl != NULL
+                ? tls_send(c->ssl, c->out + sent, c->out_len - sent)
+                : send(c->fd, c->out + sent, c->out_len - sent, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            connection_lost(c, "failed to send");
+        }
+        sent += n;
+    }
+    memmove(c->out, c->out + sent, c->out_len - sent);
+    c->out_len -= sent;
+}
+
+/**
+ * Appends a frame to c's output and sends what the socket takes now.
+ */
+void send_frame(bench_client *c, int type, const char *payload, size_t len) {
+    if (c->out_len + FRAME_HEADER_LEN + len > c->out_cap) {
+        c->out_cap = (c->out_len + FRAME_HEADER_LEN + len) * 2;
+        c->out = xrealloc(c->out, c->out_cap);
+    }
+    c->out_len += frame_encode(c->out + c->out_len, type, payload, len);
+    if (c->connected && !c->handshaking) {
+        flush_client(c);
+    }
+}
+
+void record_latency(uint64_t ns) {
+    if (num_latencies == latencies_cap) {
+        latencies_cap = latencies_cap == 0 ? 65536 : latencies_cap * 2;
+        latencies = xrealloc(latencies, latencies_cap * sizeof(uint32_t));
+    }
+    uint64_t us = ns / 1000;
+    latencies[num_latencies++] = us > UINT32_MAX ? UINT32_MAX : (uint32_t)us;
+}
+
+/**
+ * Handles one frame from the server. Chat frames carry the time they were
+ * sent, since sender and receiver share this process's clock; replayed ones
+ * from before the send phase are not counted.
+ */
+void handle_frame(bench_client *c, const frame *f) {
+    switch (f->type) {
+        case FRAME_WELCOME:
+            if (num_rooms == 1 && !c->ready) {
+                c->ready = true;
+                num_ready++;
+            }
+            break;
+        case FRAME_ROOM:
+            if (!c->ready) {
+                c->ready = true;
+                num_ready++;
+            }
+            break;
+        case FRAME_CHAT: {
+            // The sender's name, a NUL, then the send time and padding.
+            const char *text = memchr(f->payload, '\0', f->len);
+            if (text == NULL) {
+                break;
+            }
+            uint64_t sent_at = 0;
+            for (text++; text < f->payload + f->len && isdigit(*text); text++) {
+                sent_at = sent_at * 10 + (*text - '0');
+            }
+            if (sent_at < send_start) {
+                break;
+            }
+            record_latency(now_ns() - sent_at);
+            total_received++;
+            break;
+        }
+        case FRAME_BYE:
+            errno = 0;
+            connection_lost(c, "was shut down");
+    }
+}
+
+/**
+ * Reads everything the server sent and handles every complete frame.
+ */
+void handle_readable(bench_client *c) {
+    while (true) {
+        if (c->in_cap - c->in_len < 65536) {
+            c->in_cap = c->in_cap == 0 ? 65536 : c->in_cap * 2;
+            c->in = xrealloc(c->in, c->in_cap);
+        }
+        ssize_t n = c->ssl != NULL
+                ? tls_recv(c->ssl, c->in + c->in_len, c->in_cap - c->in_len)
+                : recv(c->fd, c->in + c->in_len, c->in_cap - c->in_len, 0);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return;
+            }
+            connection_lost(c, "failed to receive");
+        } else if (n == 0) {
+            errno = 0;
+            connection_lost(c, "was lost");
+        }
+        c->in_len += n;
+
+        size_t used = 0;
+        frame f;
+        int status;
+        while ((status = frame_parse(c->in + used, c->in_len - used,
+                                     MAX_FRAME_LEN, &f)) == FRAME_READY) {
+            handle_frame(c, &f);
+            used += FRAME_HEADER_LEN + f.len;
+        }
+        if (status == FRAME_INVALID) {
+            errno = EPROTO;
+            connection_lost(c, "received an invalid frame");
+        }
+        memmove(c->in, c->in + used, c->in_len - used);
+        c->in_len -= used;
+    }
+}
+
+/**
+ * Keeps the first session ticket for the connections that follow.
+ * Returns 1 if the reference was taken.
+ */
+int keep_session(SSL *ssl, SSL_SESSION *session) {
+    if (tls_session != NULL) {
+        return 0;
+    }
+    tls_session = session;
+    return 1;
+}
+
+/**
+ * Moves a TLS handshake on. Once it is done, the frames queued at connect
+ * time go out, and whatever arrived with the handshake is read.
+ */
+void handle_handshake(bench_client *c) {
+    int done = tls_handshake(c->ssl);
+    if (done < 0) {
+        fprintf(stderr, "Error: Connection %d failed the TLS handshake. %s.\n",
+                (int)(c - clients), tls_strerror());
+        exit(EXIT_FAILURE);
+    }
+    if (done == 0) {
+        return;
+    }
+    c->handshaking = false;
+    num_handshakes++;
+    num_resumed += SSL_session_reused(c->ssl);
+    flush_client(c);
+    handle_readable(c);
+}
+
+/**
+ * Finishes a non-blocking connect, then joins the chat and the client's
+ * room. Over TLS, the frames wait for the handshake.
+ */
+void handle_connected(bench_client *c) {
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0) {
+        errno = err;
+        connection_lost(c, "failed to connect");
+    }
+    c->connected = true;
+    if (tls_ctx != NULL) {
+        if ((c->ssl = tls_new(tls_ctx, c->fd, server_ip)) == NULL) {
+            fprintf(stderr, "Error: Failed to set up TLS. %s.\n",
+                    tls_strerror());
+            exit(EXIT_FAILURE);
+        }
+        if (tls_session != NULL) {
+            // A handshake updates the session it was given, so connections
+            // shaking hands at the same time each get a copy.
+            SSL_SESSION *copy = SSL_SESSION_dup(tls_session);
+            SSL_set_session(c->ssl, copy);
+            SSL_SESSION_free(copy);
+        }
+        c->handshaking = true;
+    }
+    char name[MAX_NAME_LEN + 1];
+    snprintf(name, sizeof(name), "bench%d", (int)(c - clients));
+    send_frame(c, FRAME_JOIN, name, strlen(name));
+    if (num_rooms > 1) {
+        char room[MAX_ROOM_LEN + 1];
+        snprintf(room, sizeof(room), "bench%d", c->room);
+        send_frame(c, FRAME_ROOM, room, strlen(room));
+    }
+}
+
+/**
+ * Waits up to timeout_ms for socket activity and handles it.
+ */
+void run_events(int timeout_ms) {
+    struct epoll_event events[MAX_EVENTS];
+    int n = epoll_wait(epoll_fd, events, MAX_EVENTS, timeout_ms);
+    if (n < 0) {
+        if (errno == EINTR) {
+            return;
+        }
+        fprintf(stderr, "Error: epoll_wait() failed. %s.\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < n; i++) {
+        bench_client *c = &clients[events[i].data.u32];
+        if ((events[i].events & EPOLLOUT) && !c->connected) {
+            handle_connected(c);
+        }
+        if (c->handshaking) {
+            handle_handshake(c);
+            continue;
+        }
+        if (events[i].events & EPOLLOUT) {
+            flush_client(c);
+        }
+        // A TLS read may have waited for the socket to drain, so a TLS
+        // connection is read on either event.
+        int readable = EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR;
+        if ((events[i].events & readable) || c->ssl != NULL) {
+            handle_readable(c);
+        }
+    }
+}
+
+/**
+ * Starts a non-blocking connect for client i.
+ */
+void start_client(int i, const struct sockaddr_in *addr) {
+    bench_client *c = &clients[i];
+    c->room = i % num_rooms;
+    if ((c->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0)) < 0) {
+        fprintf(stderr, "Error: Failed to create socket. %s.\n",
+                strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    if (connect(c->fd, (const struct sockaddr *)addr, sizeof(*addr)) < 0 &&
+            errno != EINPROGRESS) {
+        connection_lost(c, "failed to connect");
+    }
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    event.data.u32 = i;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, c->fd, &event) < 0) {
+        fprintf(stderr, "Error: Failed to set up epoll. %s.\n",
+                strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+}
+
+/**
+ * Sends every chat message that is due by now, rate per second per sender
+ * since start. Each one carries its send time, padded to msg_len bytes.
+ */
+void send_due(uint64_t start, uint64_t now) {
+    char text[MAX_MSG_LEN + 1];
+    long due = (long)(rate * (now - start) / 1e9);
+    for (int i = 0; i < num_senders; i++) {
+        bench_client *c = &clients[i];
+        while (c->sent < due) {
+            int len = sprintf(text, "%" PRIu64, now_ns());
+            if (len < msg_len) {
+                memset(text + len, 'x', msg_len - len);
+                len = msg_len;
+            }
+            send_frame(c, FRAME_CHAT, text, len);
+            c->sent++;
+            total_sent++;
+        }
+    }
+}
+
+int uint32_cmp(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * Returns the latency at or below which the fraction p of deliveries fall.
+ */
+uint32_t percentile(double p) {
+    size_t rank = (size_t)(p * num_latencies + 0.999999);
+    return latencies[rank == 0 ? 0 : rank - 1];
+}
+
+bool parse_option(const char *arg, int *value, const char *name, int min) {
+    if (!parse_int(arg, value, name)) {
+        return false;
+    }
+    if (*value < min) {
+        fprintf(stderr, "Error: %s must be at least %d.\n", name, min);
+        return false;
+    }
+    return true;
+}
+
+void print_usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-c clients] [-s senders] [-r rate] "
+            "[-g rooms] [-l length] [-d seconds] [-t CA file] "
+            "<server IP> <port>\n"
+            "  -c  connections to open (default 100)\n"
+            "  -s  connections that send messages (default 1)\n"
+            "  -r  messages per second per sender (default 100)\n"
+            "  -g  rooms to spread the connections over (default 1)\n"
+            "  -l  message length in bytes (default 32)\n"
+            "  -d  seconds to send for (default 10)\n"
+            "  -t  use TLS, trusting the certificates in CA file\n", prog);
+}
+
+int main(int argc, char *argv[]) {
+    int opt, rate_arg = (int)rate;
+    const char *ca_file = NULL;
+    opterr = 0;
+    while ((opt = getopt(argc, argv, "c:d:g:l:r:s:t:")) != -1) {
+        bool ok = true;
+        switch (opt) {
+            case 'c':
+                ok = parse_option(optarg, &num_clients, "clients", 1);
+                break;
+            case 'd':
+                ok = parse_option(optarg, &duration, "seconds", 1);
+                break;
+            case 'g':
+                ok = parse_option(optarg, &num_rooms, "rooms", 1);
+                break;
+            case 'l':
+                ok = parse_option(optarg, &msg_len, "length", 1);
+                if (ok && msg_len > MAX_MSG_LEN) {
+                    fprintf(stderr, "Error: length must be at most %d.\n",
+                            MAX_MSG_LEN);
+                    ok = false;
+                }
+                break;
+            case 'r':
+                ok = parse_option(optarg, &rate_arg, "rate", 1);
+                break;
+            case 's':
+                ok = parse_option(optarg, &num_senders, "senders", 1);
+                break;
+            case 't':
+                ca_file = optarg;
+                break;
+            default:
+                print_usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+        if (!ok) {
+            return EXIT_FAILURE;
+        }
+    }
+    if (argc - optind != 2) {
+        print_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    rate = rate_arg;
+    if (num_senders > num_clients) {
+        fprintf(stderr, "Error: senders must be at most clients.\n");
+        return EXIT_FAILURE;
+    }
+    if (num_rooms > num_clients) {
+        fprintf(stderr, "Error: rooms must be at most clients.\n");
+        return EXIT_FAILURE;
+    }
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    if (inet_pton(AF_INET, argv[optind], &addr.sin_addr) != 1) {
+        fprintf(stderr, "Error: Invalid IP address '%s'.\n", argv[optind]);
+        return EXIT_FAILURE;
+    }
+    int port;
+    if (!parse_int(argv[optind + 1], &port, "port number")) {
+        return EXIT_FAILURE;
+    }
+    if (port < 1024 || port > 65535) {
+        fprintf(stderr, "Error: port must be in range [1024, 65535].\n");
+        return EXIT_FAILURE;
+    }
+    addr.sin_port = htons(port);
+    server_ip = argv[optind];
+    if (ca_file != NULL &&
+            (tls_ctx = tls_client_ctx(ca_file, keep_session)) == NULL) {
+        fprintf(stderr, "Error: Failed to set up TLS. %s.\n", tls_strerror());
+        return EXIT_FAILURE;
+    }
+
+    // Each connection needs a descriptor.
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+        if (limit.rlim_cur != RLIM_INFINITY &&
+                (rlim_t)num_clients + 16 > limit.rlim_cur) {
+            fprintf(stderr, "Error: %d clients need more than the %ld "
+                    "descriptors allowed.\n", num_clients,
+                    (long)limit.rlim_cur);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if ((epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+        fprintf(stderr, "Error: Failed to set up epoll. %s.\n",
+                strerror(errno));
+        return EXIT_FAILURE;
+    }
+    clients = calloc(num_clients, sizeof(bench_client));
+    if (clients == NULL) {
+        fprintf(stderr, "Error: calloc() failed. %s.\n", strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    // Connect everyone and wait until each is in its room.
+    printf("Connecting %d clients in %d room%s...\n", num_clients, num_rooms,
+           num_rooms == 1 ? "" : "s");
+    fflush(stdout);
+    uint64_t setup_start = now_ns();
+    int started = 0;
+    while (num_ready < num_clients) {
+        while (started < num_clients && started - num_ready < MAX_PENDING) {
+            start_client(started++, &addr);
+        }
+        run_events(10);
+        if (now_ns() - setup_start > SETUP_TIMEOUT * 1000000000ULL) {
+            fprintf(stderr, "Error: Only %d of %d clients were ready after "
+                    "%d seconds.\n", num_ready, num_clients, SETUP_TIMEOUT);
+            return EXIT_FAILURE;
+        }
+    }
+    printf("Connected in %.2f s.\n", (now_ns() - setup_start) / 1e9);
+    if (tls_ctx != NULL) {
+        printf("TLS:       %d handshakes, %d resumed\n", num_handshakes,
+               num_resumed);
+    }
+
+    // Every message reaches the rest of its sender's room.
+    int *room_sizes = calloc(num_rooms, sizeof(int));
+    if (room_sizes == NULL) {
+        fprintf(stderr, "Error: calloc() failed. %s.\n", strerror(errno));
+        return EXIT_FAILURE;
+    }
+    for (int i = 0; i < num_clients; i++) {
+        room_sizes[clients[i].room]++;
+    }
+
+    printf("Sending %d msg/s from each of %d sender%s for %d s...\n",
+           rate_arg, num_senders, num_senders == 1 ? "" : "s", duration);
+    fflush(stdout);
+    uint64_t start = now_ns(), end = start + duration * 1000000000ULL, now;
+    send_start = start;
+    while ((now = now_ns()) < end) {
+        send_due(start, now);
+        run_events(1);
+    }
+    for (int i = 0; i < num_senders; i++) {
+        expected += clients[i].sent * (room_sizes[clients[i].room] - 1);
+    }
+    uint64_t drain_end = now_ns() + DRAIN_TIMEOUT * 1000000000ULL;
+    while (total_received < expected && now_ns() < drain_end) {
+        run_events(10);
+    }
+    double elapsed = (now_ns() - start) / 1e9;
+
+    printf("Sent:      %ld msgs (%.0f msg/s)\n", total_sent,
+           total_sent / (double)duration);
+    printf("Delivered: %ld of %ld (%.0f msg/s)\n", total_received, expected,
+           total_received / elapsed);
+    if (num_latencies > 0) {
+        qsort(latencies, num_latencies, sizeof(uint32_t), uint32_cmp);
+        printf("Latency:   p50 %" PRIu32 " us, p99 %" PRIu32 " us, "
+               "p999 %" PRIu32 " us, max %" PRIu32 " us\n", percentile(0.5),
+               percentile(0.99), percentile(0.999),
+               latencies[num_latencies - 1]);
+    }
+
+    for (int i = 0; i < num_clients; i++) {
+        SSL_free(clients[i].ssl);
+        close(clients[i].fd);
+        free(clients[i].in);
+        free(clients[i].out);
+    }
+    free(clients);
+    free(room_sizes);
+    free(latencies);
+    SSL_SESSION_free(tls_session);
+    SSL_CTX_free(tls_ctx);
+    close(epoll_fd);
+    return total_received < expected ? EXIT_FAILURE : EXIT_SUCCESS;
+}
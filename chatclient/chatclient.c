@@ -6,68 +6,452 @@
 #include <arpa/inet.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <openssl/pem.h>
+#include <poll.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/select.h>
 #include <sys/socket.h>
 #include <unistd.h>
+#include "protocol.h"
+#include "tls.h"
 #include "util.h"
 
+// Output to the screen is collected and written once per wakeup.
+#define SCREEN_BUFLEN  65536
+// Input is not read while this much is still waiting to go to the server.
+#define MAX_OUT_QUEUE  (1024 * 1024)
+
+/**
+ * The client connects, shakes hands if it uses TLS, waits for the welcome
+ * message and sends its name, then chats. After "bye" or the end of the
+ * input it finishes sending and waits for the server to close the
+ * connection.
+ */
+enum client_state_t {
+    CONNECTING, HANDSHAKING, AWAIT_WELCOME, CHATTING, CLOSING
+};
+
 int client_socket = -1;
+// Set if the connection uses TLS. The session the server hands out is kept
+// in session_path, if given, so the next run can skip the full handshake.
+SSL_CTX *tls_ctx = NULL;
+SSL *ssl = NULL;
+const char *session_path = NULL;
+int state = CONNECTING;
 char username[MAX_NAME_LEN + 1];
-char inbuf[BUFLEN + 1];
-char outbuf[MAX_MSG_LEN + 1];
+bool scripted = false, prompt_needed = false;
+line_reader input;
+// Frames not yet taken by the socket.
+char *outq = NULL;
+size_t out_len = 0, out_cap = 0;
+// Bytes received from the server that do not form a whole frame yet. It
+// grows to fit the largest frame seen, normally the welcome message.
+char *inbuf = NULL;
+size_t in_len = 0, in_cap = 0;
+char screen[SCREEN_BUFLEN];
+size_t screen_len = 0;
 
-int handle_stdin() { 
-    int getStringResult = get_string(outbuf,MAX_MSG_LEN);
-    if(getStringResult == TOO_LONG){
-        fprintf(stderr,"Sorry, limit your message to %d characters.\n",MAX_MSG_LEN);
-        fflush(stdout);
-    }else if (getStringResult == OK){
-        if((send(client_socket,outbuf,strlen(outbuf),0))== -1){
-        fprintf(stderr, "Warning: Failed to send message to server. %s.\n",
+void write_all(int fd, const char *buf, size_t len){
+    while(len > 0){
+        ssize_t n = write(fd, buf, len);
+        if(n < 0){
+            if(errno == EINTR){
+                continue;
+            }
+            return;
+        }
+        buf += n;
+        len -= n;
+    }
+}
+
+void flush_screen(){
+    write_all(STDOUT_FILENO, screen, screen_len);
+    screen_len = 0;
+}
+
+/**
+ * Adds formatted text to the screen buffer. Text too large for the buffer,
+ * like a long user list, is written on its own.
+ */
+__attribute__((format(printf, 1, 2)))
+void screen_printf(const char *format, ...){
+    va_list args;
+    va_start(args, format);
+    int n = vsnprintf(screen + screen_len, SCREEN_BUFLEN - screen_len, format, args);
+    va_end(args);
+    if(n < 0 || (size_t)n < SCREEN_BUFLEN - screen_len){
+        screen_len += n < 0 ? 0 : n;
+        return;
+    }
+    flush_screen();
+    char *text = n < SCREEN_BUFLEN ? screen : malloc(n + 1);
+    if(text == NULL){
+        return;
+    }
+    va_start(args, format);
+    vsnprintf(text, n + 1, format, args);
+    va_end(args);
+    if(text == screen){
+        screen_len = n;
+    }else{
+        write_all(STDOUT_FILENO, text, n);
+        free(text);
+    }
+}
+
+ssize_t net_send(const char *buf, size_t len){
+    if(ssl != NULL){
+        return tls_send(ssl, buf, len);
+    }
+    return send(client_socket, buf, len, MSG_NOSIGNAL);
+}
+
+ssize_t net_recv(char *buf, size_t len){
+    if(ssl != NULL){
+        return tls_recv(ssl, buf, len);
+    }
+    return recv(client_socket, buf, len, 0);
+}
+
+/**
+ * Saves a session ticket from the server. The file holds the session's
+ * secret, so only its owner may read it.
+ */
+int save_session(SSL *s, SSL_SESSION *session){
+    int fd = open(session_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    FILE *fp = fd < 0 ? NULL : fdopen(fd, "w");
+    if(fp == NULL || !PEM_write_SSL_SESSION(fp, session)){
+        flush_screen();
+        fprintf(stderr, "Warning: Failed to save TLS session to '%s'. %s.\n",
+                session_path, strerror(errno));
+    }
+    if(fp != NULL){
+        fclose(fp);
+    }else if(fd >= 0){
+        close(fd);
+    }
+    return 0;
+}
+
+/**
+ * Offers the session saved by an earlier run, if there is one, so the
+ * handshake can resume it.
+ */
+void load_session(){
+    FILE *fp = session_path == NULL ? NULL : fopen(session_path, "r");
+    if(fp == NULL){
+        return;
+    }
+    SSL_SESSION *session = PEM_read_SSL_SESSION(fp, NULL, NULL, NULL);
+    fclose(fp);
+    if(session != NULL){
+        SSL_set_session(ssl, session);
+        SSL_SESSION_free(session);
+    }
+}
+
+/**
+ * Queues a frame for the server. Frames are sent when the main loop finds
+ * the socket writable, so a burst of input lines goes out in a few large
+ * sends.
+ */
+void send_frame(int type, const char *payload, size_t len){
+    if(out_len + FRAME_HEADER_LEN + len > out_cap){
+        size_t cap = (out_len + FRAME_HEADER_LEN + len) * 2;
+        char *grown = realloc(outq, cap);
+        if(grown == NULL){
+            fprintf(stderr, "Error: realloc() failed. %s.\n", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        outq = grown;
+        out_cap = cap;
+    }
+    out_len += frame_encode(outq + out_len, type, payload, len);
+}
+
+/**
+ * Sends as much of the queued output as the socket takes.
+ * Returns false if the connection failed.
+ */
+bool flush_out(){
+    size_t sent = 0;
+    while(sent < out_len){
+        ssize_t n = net_send(outq + sent, out_len - sent);
+        if(n == -1){
+            if(errno == EINTR){
+                continue;
+            }
+            if(errno == EAGAIN || errno == EWOULDBLOCK){
+                break;
+            }
+            return false;
+        }
+        sent += n;
+    }
+    memmove(outq, outq + sent, out_len - sent);
+    out_len -= sent;
+    return true;
+}
+
+/**
+ * Turns "/join <room>" and "/leave" into a room frame for the server.
+ * Returns false if text is not a room command, after printing why if it
+ * looked like one.
+ */
+bool room_command(const char *text, const char **room, size_t *len, bool *valid){
+    *valid = true;
+    if(strcmp(text,"/leave") == 0){
+        *room = text;
+        *len = 0;
+        return true;
+    }
+    if(strncmp(text,"/join ",6) != 0){
+        return false;
+    }
+    *room = text + 6;
+    *len = strlen(*room);
+    if(*len == 0 || *len > MAX_ROOM_LEN){
+        flush_screen();
+        fprintf(stderr,"Sorry, room names must be 1 to %d characters.\n",MAX_ROOM_LEN);
+        *valid = false;
+    }
+    return true;
+}
+
+/**
+ * Says goodbye to the server. The client exits once the server has closed
+ * the connection, so nothing queued is lost.
+ */
+void say_bye(){
+    send_frame(FRAME_BYE, NULL, 0);
+    screen_printf("Goodbye.\n");
+    state = CLOSING;
+}
+
+void handle_line(const char *text){
+    const char *room;
+    size_t room_len;
+    bool valid;
+    if(room_command(text, &room, &room_len, &valid)){
+        if(valid){
+            send_frame(FRAME_ROOM, room, room_len);
+        }
+    }else if(strcmp(text,"bye") == 0){
+        say_bye();
+    }else{
+        send_frame(FRAME_CHAT, text, strlen(text));
+    }
+}
+
+/**
+ * Handles every whole line that is ready on the input, with one read().
+ */
+void handle_stdin() {
+    char text[MAX_MSG_LEN + 1];
+    if(fill_lines(&input) < 0){
+        flush_screen();
+        fprintf(stderr, "Warning: Failed to read message from keyboard. %s.\n",
                 strerror(errno));
+        return;
+    }
+    int result;
+    while(state == CHATTING && (result = next_line(&input, text, MAX_MSG_LEN)) != NO_LINE){
+        if(result == TOO_LONG){
+            flush_screen();
+            fprintf(stderr,"Sorry, limit your message to %d characters.\n",MAX_MSG_LEN);
+        }else if(result == OK){
+            handle_line(text);
         }
-        if(!strncmp(outbuf,"bye",3)){
-            printf("Goodbye.\n");
-            return -1;
+        prompt_needed = true;
+    }
+    if(state == CHATTING && input.eof && input.len == 0){
+        say_bye();
+    }
+}
+
+/**
+ * Prints one frame from the server.
+ * Returns -1 if the server is shutting down, EXIT_SUCCESS otherwise.
+ */
+int handle_frame(const frame *f){
+    int len = (int)f->len;
+    switch(f->type){
+        case FRAME_WELCOME:
+            screen_printf("\n%.*s\n\n", len, f->payload);
+            if(state == AWAIT_WELCOME){
+                send_frame(FRAME_JOIN,username,strlen(username));
+                state = CHATTING;
+            }
+            break;
+        case FRAME_ROOM:
+            screen_printf("\n%.*s\n", len, f->payload);
+            break;
+        case FRAME_JOIN:
+            screen_printf("\nUser [%.*s] joined the chat room.\n", len, f->payload);
+            break;
+        case FRAME_LEAVE:
+            screen_printf("\nUser [%.*s] left the chat room.\n", len, f->payload);
+            break;
+        case FRAME_CHAT: {
+            // The sender's name, a NUL, then the text.
+            const char *text = memchr(f->payload, '\0', f->len);
+            int name_len = text == NULL ? 0 : (int)(text - f->payload);
+            text = text == NULL ? f->payload : text + 1;
+            screen_printf("\n[%.*s]: %.*s\n", name_len, f->payload,
+                          (int)(f->payload + f->len - text), text);
+            break;
         }
+        case FRAME_BYE:
+            screen_printf("\nServer initiated shutdown.\n");
+            return -1;
     }
+    prompt_needed = true;
     return EXIT_SUCCESS;
 }
 
+/**
+ * Reads everything the server sent and handles every complete frame,
+ * however the frames were split or merged on the way.
+ * Returns EXIT_SUCCESS, EXIT_FAILURE if the connection was lost, or -1 if
+ * the connection closed as expected.
+ */
 int handle_client_socket() {
-    int bytes_recvd;
-    if((bytes_recvd = recv(client_socket,inbuf,BUFLEN,0))<0){
-        fprintf(stderr, "Warning: Failed to receive incoming message. %s.\n",
-                strerror(errno));
-    }else if(bytes_recvd == 0){
-        fprintf(stderr, "\nConnection to server has been lost.\n");
-        return EXIT_FAILURE; 
-    }else{
-        inbuf[bytes_recvd] = '\0';
-        if(!strncmp(inbuf,"bye",3)){
-            printf("\nServer initiated shutdown.\n");
-            return -1; 
-        }else{
-            printf("\n%s\n",inbuf);
+    while(true){
+        if(in_cap - in_len < BUFLEN){
+            size_t cap = in_cap == 0 ? 2 * BUFLEN : in_cap * 2;
+            char *grown = realloc(inbuf, cap);
+            if(grown == NULL){
+                fprintf(stderr, "Error: realloc() failed. %s.\n", strerror(errno));
+                return EXIT_FAILURE;
+            }
+            inbuf = grown;
+            in_cap = cap;
+        }
+        ssize_t bytes_recvd;
+        bytes_recvd = net_recv(inbuf + in_len,in_cap - in_len);
+        if(bytes_recvd < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)){
+            return EXIT_SUCCESS;
+        }else if(bytes_recvd < 0 && errno == EINTR){
+            continue;
+        }else if(bytes_recvd < 0 && errno != ECONNRESET){
+            flush_screen();
+            fprintf(stderr, "Warning: Failed to receive incoming message. %s.\n",
+                    strerror(errno));
+            return EXIT_SUCCESS;
+        }else if(bytes_recvd <= 0){
+            flush_screen();
+            if(state == CLOSING){
+                return -1;
+            }else if(state != CHATTING){
+                fprintf(stderr, "All connections are busy. Try again later.\n");
+            }else{
+                fprintf(stderr, "\nConnection to server has been lost.\n");
+            }
+            return EXIT_FAILURE;
+        }
+        in_len += bytes_recvd;
+
+        size_t used = 0;
+        frame f;
+        int status;
+        while((status = frame_parse(inbuf + used, in_len - used, MAX_FRAME_LEN, &f)) == FRAME_READY){
+            used += FRAME_HEADER_LEN + f.len;
+            if(handle_frame(&f) == -1){
+                return -1;
+            }
+        }
+        if(status == FRAME_INVALID){
+            flush_screen();
+            fprintf(stderr, "\nError: Invalid message from server.\n");
+            return EXIT_FAILURE;
         }
+        memmove(inbuf, inbuf + used, in_len - used);
+        in_len -= used;
     }
-    return EXIT_SUCCESS;
+}
+
+/**
+ * Finishes the non-blocking connect, and starts TLS if it is used.
+ * Returns false if the connection failed.
+ */
+bool handle_connected(const char *server_ip){
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if(getsockopt(client_socket, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0){
+        fprintf(stderr, "Error: Failed to connect to server. %s.\n",
+                strerror(err != 0 ? err : errno));
+        return false;
+    }
+    if(tls_ctx == NULL){
+        state = AWAIT_WELCOME;
+        return true;
+    }
+    if((ssl = tls_new(tls_ctx, client_socket, server_ip)) == NULL){
+        fprintf(stderr, "Error: Failed to set up TLS. %s.\n", tls_strerror());
+        return false;
+    }
+    load_session();
+    state = HANDSHAKING;
+    return true;
+}
+
+/**
+ * Moves the TLS handshake on.
+ * Returns 1 once it is done, 0 if it is waiting for the socket, or -1 if it
+ * failed.
+ */
+int handle_handshake(){
+    int done = tls_handshake(ssl);
+    if(done < 0){
+        fprintf(stderr, "Error: TLS handshake failed. %s.\n", tls_strerror());
+    }else if(done > 0){
+        state = AWAIT_WELCOME;
+        if(!scripted){
+            screen_printf("Connected with %s%s.\n", SSL_get_version(ssl),
+                          SSL_session_reused(ssl) ? ", resuming the last session" : "");
+        }
+    }
+    return done;
 }
 
 int main(int argc, char *argv[]) {
-    if(argc != 3){
-        fprintf(stderr,"Usage: %s <server IP> <port>\n",argv[0]);
+    const char *script = NULL, *name = NULL, *ca_file = NULL;
+    bool use_tls = false;
+    int input_fd = STDIN_FILENO;
+    int opt;
+    opterr = 0;
+    while((opt = getopt(argc, argv, "c:f:n:s:t")) != -1){
+        if(opt == 'c'){
+            ca_file = optarg;
+            use_tls = true;
+        }else if(opt == 'f'){
+            script = optarg;
+        }else if(opt == 'n'){
+            name = optarg;
+        }else if(opt == 's'){
+            session_path = optarg;
+        }else if(opt == 't'){
+            use_tls = true;
+        }else{
+            argc = 0;
+            break;
+        }
+    }
+    if(argc - optind != 2 || (session_path != NULL && !use_tls)){
+        fprintf(stderr,"Usage: %s [-n username] [-f script] [-t] [-c CA file] "
+                "[-s session file] <server IP> <port>\n",argv[0]);
         return EXIT_FAILURE;
     }
+    argv += optind - 1;
 
-    int bytes_recvd, retval = EXIT_SUCCESS;
+    int retval = EXIT_SUCCESS;
     struct sockaddr_in serv_addr;
     socklen_t addrlen = sizeof(struct sockaddr_in);
     memset(&serv_addr, 0, addrlen);
-    
+
     int ip_conversion = inet_pton(AF_INET, argv[1], &serv_addr.sin_addr);
     if (ip_conversion == 0) {
         fprintf(stderr, "Error: Invalid IP address '%s'.\n", argv[1]);
@@ -89,83 +473,159 @@ int main(int argc, char *argv[]) {
         fprintf(stderr, "Error: port must be in range [1024, 65535].\n");
         return EXIT_FAILURE;
     }
-
     serv_addr.sin_port = htons(port);
-    bool usernameValid = false;
+
+    // With -t the server's certificate must be trusted by the system, and
+    // with -c by the given file, which may be the server's own certificate.
+    if(use_tls && (tls_ctx = tls_client_ctx(ca_file,
+            session_path != NULL ? save_session : NULL)) == NULL){
+        fprintf(stderr, "Error: Failed to set up TLS. %s.\n", tls_strerror());
+        return EXIT_FAILURE;
+    }
+
+    // In scripted mode, the lines of a file, or of standard input if it is
+    // "-", are sent as fast as the server takes them, with no prompts.
+    if(script != NULL){
+        scripted = true;
+        if(strcmp(script, "-") != 0 && (input_fd = open(script, O_RDONLY | O_CLOEXEC)) < 0){
+            fprintf(stderr, "Error: Cannot open script '%s'. %s.\n", script,
+                    strerror(errno));
+            return EXIT_FAILURE;
+        }
+        if(name == NULL){
+            fprintf(stderr, "Error: A script needs a username, given with -n.\n");
+            return EXIT_FAILURE;
+        }
+    }
+    init_line_reader(&input, input_fd);
+
+    if(name != NULL){
+        if(strlen(name) == 0 || strlen(name) > MAX_NAME_LEN){
+            fprintf(stderr, "Sorry, limit your username to %d characters.\n",MAX_NAME_LEN);
+            return EXIT_FAILURE;
+        }
+        strcpy(username, name);
+    }
+    bool usernameValid = name != NULL;
     int getStringResult = NO_INPUT;
     while(!usernameValid){
         printf("Enter your username: ");
         fflush(stdout);
-        getStringResult = get_string(username,MAX_NAME_LEN);
+        while((getStringResult = next_line(&input, username, MAX_NAME_LEN)) == NO_LINE){
+            if(input.eof || fill_lines(&input) <= 0){
+                printf("\n");
+                return EXIT_FAILURE;
+            }
+        }
         if(getStringResult == TOO_LONG){
             fprintf(stderr, "Sorry, limit your username to %d characters.\n",MAX_NAME_LEN);
         }else if (getStringResult == OK){
             usernameValid = true;
         }
     }
-    
-    printf("Hello, %s. Let's try to connect to the server.\n",username);
-    if ((client_socket = socket(AF_INET , SOCK_STREAM , 0)) < 0) {
+
+    if(!scripted){
+        printf("Hello, %s. Let's try to connect to the server.\n",username);
+        fflush(stdout);
+    }
+    if ((client_socket = socket(AF_INET , SOCK_STREAM | SOCK_NONBLOCK , 0)) < 0) {
         fprintf(stderr, "Error: Failed to create socket. %s.\n",
                 strerror(errno));
         retval =  EXIT_FAILURE;
         goto EXIT;
     }
-    
-    if((connect(client_socket,(struct sockaddr *)&serv_addr,addrlen)) == -1){
+
+    if(connect(client_socket,(struct sockaddr *)&serv_addr,addrlen) == -1 &&
+            errno != EINPROGRESS){
         fprintf(stderr, "Error: Failed to connect to server. %s.\n",
                 strerror(errno));
         retval =  EXIT_FAILURE;
         goto EXIT;
     }
-    
-    if((bytes_recvd = recv(client_socket,inbuf,BUFLEN,0))<0){
-        fprintf(stderr, "Error: Failed to receive message from server. %s.\n",
-                strerror(errno));
-        return EXIT_FAILURE;
-    }else if(bytes_recvd == 0){
-        fprintf(stderr, "All connections are busy. Try again later.\n");
-        return EXIT_FAILURE;
-    }else{
-        printf("\n%s\n\n",inbuf);
-    }
-
 
-    if((send(client_socket,username,strlen(username),0))== -1){ 
-        fprintf(stderr, "Error: Failed to send username to server. %s.\n",
-                strerror(errno));
-        return EXIT_FAILURE;
-    }
-    fd_set fds;
+    // Standard input stays blocking, since it may be shared with the shell,
+    // but it is only read after poll() reports it ready, once per wakeup.
+    struct pollfd fds[2];
+    fds[0].fd = client_socket;
     while(true){
-        FD_ZERO(&fds);
-        FD_SET(client_socket,&fds);
-        FD_SET(STDIN_FILENO,&fds);
-        printf("[%s]: ", username);
-        fflush(stdout);
-        if((select(client_socket+1, &fds, NULL, NULL, NULL)) == -1){
-            fprintf(stderr, "Error: select() failed. %s.\n", strerror(errno));
-            return EXIT_FAILURE;
+        fds[0].events = POLLIN;
+        if(state == CONNECTING || out_len > 0 ||
+                (state == HANDSHAKING && !SSL_want_read(ssl))){
+            fds[0].events |= POLLOUT;
+        }
+        // A closed pipe reports POLLHUP whatever the events asked for, so
+        // input that is not wanted now is left out altogether.
+        fds[1].fd = state == CHATTING && !input.eof &&
+                    out_len < MAX_OUT_QUEUE ? input_fd : -1;
+        fds[1].events = POLLIN;
+        if(poll(fds, 2, -1) == -1){
+            if(errno == EINTR){
+                continue;
+            }
+            fprintf(stderr, "Error: poll() failed. %s.\n", strerror(errno));
+            retval = EXIT_FAILURE;
+            goto EXIT;
         }
-        
-        if ((FD_ISSET(client_socket, &fds))){
+
+        if(state == CONNECTING){
+            if(fds[0].revents != 0 && !handle_connected(argv[1])){
+                retval = EXIT_FAILURE;
+                goto EXIT;
+            }
+            continue;
+        }
+        if(state == HANDSHAKING){
+            int done = fds[0].revents != 0 ? handle_handshake() : 0;
+            if(done < 0){
+                retval = EXIT_FAILURE;
+                goto EXIT;
+            }
+            if(done == 0){
+                continue;
+            }
+            // Read whatever arrived along with the end of the handshake.
+            fds[0].revents |= POLLIN;
+        }
+        if(fds[0].revents & (POLLIN | POLLHUP | POLLERR)){
             retval = handle_client_socket();
+            if(retval == EXIT_FAILURE || retval == -1){
+                goto EXIT;
+            }
         }
-        if (retval == EXIT_FAILURE || retval == -1){
+        if(fds[1].revents & (POLLIN | POLLHUP | POLLERR)){
+            handle_stdin();
+        }
+        if(out_len > 0 && !flush_out()){
+            flush_screen();
+            fprintf(stderr, "Warning: Failed to send message to server. %s.\n",
+                    strerror(errno));
+            retval = EXIT_FAILURE;
             goto EXIT;
         }
-        if ((FD_ISSET(STDIN_FILENO, &fds))){
-            retval = handle_stdin();
+        if(state == CLOSING && out_len == 0){
+            // Everything is sent; wait for the server to close.
+            shutdown(client_socket, SHUT_WR);
         }
-        if (retval == EXIT_FAILURE || retval == -1){
-            goto EXIT;
-        } 
+        // The prompt is only shown again after something was printed over it.
+        if(!scripted && state == CHATTING && prompt_needed){
+            screen_printf("[%s]: ", username);
+            prompt_needed = false;
+        }
+        flush_screen();
     }
-    
+
     EXIT:
+        flush_screen();
         if (fcntl(client_socket, F_GETFD) >= 0) {
             close(client_socket);
         }
+        if(input_fd != STDIN_FILENO){
+            close(input_fd);
+        }
+        SSL_free(ssl);
+        SSL_CTX_free(tls_ctx);
+        free(inbuf);
+        free(outq);
         if(retval == -1){
             retval = EXIT_SUCCESS;
         }
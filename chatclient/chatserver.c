@@ -1,407 +1,2428 @@
 #include <arpa/inet.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <signal.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <sys/uio.h>
 #include <time.h>
 #include <unistd.h>
+#include "log.h"
+#include "protocol.h"
+#include "tls.h"
 #include "util.h"
 
-// Max number of concurrent clients.
-#define MAX_CONNECTIONS 3
+// Max number of concurrent clients. The connection table grows as needed up
+// to this limit, which is far more than the default descriptor limit.
+#define MAX_CONNECTIONS 65536
+// Max number of ready sockets handled per epoll_wait() call.
+#define MAX_EVENTS      256
+// Max bytes queued for a client that is not reading before it is dropped.
+#define MAX_BACKLOG     (1024 * 1024)
+// Largest frame a client may send: a chat message.
+#define MAX_IN_FRAME    (FRAME_HEADER_LEN + MAX_MSG_LEN)
+// Max queued messages handed to one sendmsg() call.
+#define MAX_IOVECS      64
+// Max number of worker threads, each with its own listening socket.
+#define MAX_SHARDS      64
+// Rooms are found by name in a chained hash table with this many buckets.
+#define ROOM_BUCKETS    1024
+// Every named client starts out in this room.
+#define DEFAULT_ROOM    "lobby"
+// Chat messages kept per room and replayed to everyone who joins it.
+#define HISTORY_LEN     100
+// Max rooms with a history, so made-up room names cannot use up memory.
+#define MAX_HISTORIES   4096
+// Bounds on the size of the history file, which is mapped into memory.
+#define MIN_HISTORY_FILE (1024 * 1024)
+#define MAX_HISTORY_FILE (256 * 1024 * 1024)
+#define HISTORY_MAGIC   "CHATLOG1"
+// Max connections a shard accepts per wakeup, so a flood of new connections
+// cannot starve the clients already connected.
+#define MAX_ACCEPTS     64
+// Seconds a connection has to finish any TLS handshake and send its name.
+#define NAME_TIMEOUT    10
+// Timeouts are kept in a wheel with a slot per second. Deadlines further out
+// than a turn of the wheel wait in their slot for another turn.
+#define WHEEL_SLOTS     64
+// Source addresses with a connection rate limit are found by hashing into
+// this many buckets. Beyond MAX_TRACKED_IPS, new addresses are refused.
+#define IP_BUCKETS      4096
+#define MAX_TRACKED_IPS 65536
+// Latency histograms have a bucket per power of two microseconds: bucket i
+// counts times under 2^i us, and the last one all longer times.
+#define HIST_BUCKETS    24
+// Max size of one metrics report.
+#define MAX_METRICS_LEN 65536
 
-int server_socket = -1, num_connections = 0;
-int client_sockets[MAX_CONNECTIONS];
+/**
+ * A connection starts out waiting for its user name and only then joins the
+ * chat room.
+ */
+enum client_state_t { CLIENT_AWAIT_NAME, CLIENT_ACTIVE };
+
+/**
+ * An encoded frame shared by every client it is queued for, on any thread.
+ * It is freed when the last reference is released.
+ */
+typedef struct message {
+    atomic_int refs;
+    uint64_t created_ns;    // when a chat message arrived, else 0
+    size_t len;
+    char data[];
+} message;
+
+/**
+ * Lock-free queue with many producers and one consumer, after Dmitry
+ * Vyukov's intrusive MPSC queue. Other threads push messages to be
+ * broadcast on the owning thread; pushing is one atomic exchange.
+ */
+typedef struct inbox_node {
+    _Atomic(struct inbox_node *) next;
+    message *msg;
+    struct room *room;      // the room to deliver msg to
+} inbox_node;
+
+typedef struct inbox {
+    _Atomic(inbox_node *) head;     // last node pushed
+    inbox_node *tail;               // next node to pop, owned by the consumer
+    inbox_node stub;
+} inbox;
+
+struct shard;
+struct client;
+
+/**
+ * Allows bursts of up to twice the rate, refilling continuously.
+ */
+typedef struct token_bucket {
+    double tokens;
+    double last;            // when tokens was last brought up to date
+} token_bucket;
+
+/**
+ * The connection rate limit of one source address.
+ */
+typedef struct ip_limit {
+    struct ip_limit *next;  // hash chain, guarded by ip_limits_lock
+    in_addr_t ip;
+    token_bucket bucket;
+} ip_limit;
+
+/**
+ * The recent chat messages of a room, oldest first, in a ring. Histories are
+ * kept by name, apart from the rooms, so a room that empties and fills
+ * again, or that was loaded from the history file, still has its past.
+ */
+typedef struct history {
+    struct history *next;   // hash chain, guarded by histories_lock
+    pthread_mutex_t lock;
+    char name[MAX_ROOM_LEN + 1];
+    message *msgs[HISTORY_LEN];
+    int start, len;
+} history;
+
+/**
+ * The history file starts with this header, followed by records appended
+ * as messages arrive. used counts the bytes of whole records.
+ */
+typedef struct history_file_header {
+    char magic[8];
+    uint64_t used;
+} history_file_header;
+
+/**
+ * One shard's members of a room. Only the owning shard touches members;
+ * other shards read num_members to skip shards with nobody in the room.
+ */
+typedef struct room_shard {
+    struct client **members;
+    atomic_int num_members;
+    int members_cap;
+} room_shard;
+
+/**
+ * A chat room. Messages are routed through the room's members on each
+ * shard, so their cost depends on the size of the room, not the server.
+ * The sorted names, kept up to date on every join and leave, list the room
+ * without sorting. A room is unlinked from the directory when its last
+ * member leaves and freed once no queued message refers to it.
+ */
+typedef struct room {
+    struct room *next;      // hash chain, guarded by directory_lock
+    atomic_int refs;        // one per member and per queued inbox node
+    char *name;
+    history *history;       // NULL if the room keeps none
+    char **names;           // guarded by directory_lock
+    int num_names, names_cap;
+    room_shard shards[];    // one per shard
+} room;
+
+/**
+ * A connected client, owned by one shard. Clients are found by socket
+ * descriptor through the shard's clients_by_fd. The shard's dense clients
+ * array of named clients, and the room's members array, are arrays in which
+ * each client knows its own index so it can be removed in constant time.
+ * Received bytes are collected in in until they form whole frames. Messages
+ * the socket would not take yet wait in a ring of references until epoll
+ * reports it writable; out_offset bytes of the first one have been sent
+ * already.
+ */
+typedef struct client {
+    struct shard *shard;
+    int fd;
+    int index;              // position in clients, or -1 until named
+    room *room;             // NULL until named
+    int room_index;         // position in room's members on this shard
+    enum client_state_t state;
+    bool closing;           // disconnect after this batch of events
+    SSL *ssl;               // NULL for plain TCP
+    bool handshaking;       // TLS handshake not done yet
+    int pending_index;      // position in shard's tls_pending, or -1
+    double connected_at;
+    double last_active;     // when the client last sent anything
+    token_bucket messages;
+    bool throttled;         // over its message rate, and logged as such
+    struct client *timer_prev, *timer_next;
+    int timer_slot;         // slot in shard's wheel, or -1
+    char *username;
+    char ip[INET_ADDRSTRLEN];
+    int port;
+    char in[MAX_IN_FRAME];
+    size_t in_len;
+    message **out;
+    int out_cap;
+    int out_head;
+    int out_len;
+    size_t out_offset;
+    size_t out_bytes;       // total unsent bytes, for MAX_BACKLOG
+} client;
+
+/**
+ * A shard's counters. Only the owning shard writes them, with a load and a
+ * store rather than a locked add, and the metrics thread adds up every
+ * shard's when asked for a report. The queue figures are sampled once a
+ * second.
+ */
+typedef struct shard_stats {
+    atomic_long connections;
+    atomic_long msgs_in, bytes_in, msgs_out, bytes_out;
+    atomic_long refused;        // connections turned away at accept
+    atomic_long timed_out, dropped_slow, shed_messages;
+    atomic_long queued_clients; // clients with a backlog
+    atomic_long queued_msgs, queued_bytes, max_queued_bytes;
+    atomic_long fanout_us[HIST_BUCKETS];    // chat message to queued here
+    atomic_long loop_us[HIST_BUCKETS];      // work done per wakeup
+} shard_stats;
+
+/**
+ * A worker thread with its own epoll loop and SO_REUSEPORT listening socket,
+ * so the kernel spreads new connections across shards. A shard only ever
+ * touches its own clients; messages for other shards' clients go through
+ * their inboxes, and event_fd wakes the owner when its inbox gets work.
+ * TLS clients with queued output are listed in tls_pending and written once
+ * the batch of events is done, so a busy batch shares records. Every client
+ * with a deadline is in a list in the timer wheel; now is read once per
+ * wakeup.
+ */
+typedef struct shard {
+    int id;
+    pthread_t thread;
+    int listen_fd;
+    int epoll_fd;
+    int event_fd;
+    atomic_bool wakeup_pending;
+    inbox inbox;
+    int num_connections;
+    client **clients_by_fd;
+    int clients_by_fd_cap;
+    client **clients;
+    int clients_cap;
+    client **closing;
+    int num_closing, closing_cap;
+    client **tls_pending;
+    int num_tls_pending, tls_pending_cap;
+    char tls_buf[TLS_RECORD_LEN];
+    bool accepts_pending;
+    double now;
+    client *wheel[WHEEL_SLOTS];
+    long wheel_tick;        // last second whose slot was handled
+    shard_stats stats;
+} shard;
+
+shard shards[MAX_SHARDS];
+int num_shards = 0;
+atomic_int num_sockets = 0;
+atomic_bool running = true;
+atomic_int exit_status = EXIT_SUCCESS;
+
+// Every room with members, by name, on every shard.
+pthread_mutex_t directory_lock = PTHREAD_MUTEX_INITIALIZER;
+room *rooms[ROOM_BUCKETS];
+
+// Every room's history, by name, and the optional file they are saved in.
+// Locks are taken in the order directory_lock, histories_lock, a history's
+// lock, history_file_lock.
+pthread_mutex_t histories_lock = PTHREAD_MUTEX_INITIALIZER;
+history *histories[ROOM_BUCKETS];
+int num_histories = 0;
+pthread_mutex_t history_file_lock = PTHREAD_MUTEX_INITIALIZER;
+int history_fd = -1;
+char *history_map = NULL;
+size_t history_map_len = 0;
+bool history_file_full = false;
+
+// Set if the server speaks TLS. It is shared by every shard, and so is the
+// key that seals session tickets, so a client can resume on any shard.
+SSL_CTX *tls_ctx = NULL;
+
+// Admission limits, each off if 0: new connections per second from one
+// address, messages per second from one client, and seconds a named client
+// may stay silent.
+int ip_rate = 0, msg_rate = 0, idle_timeout = 0;
+pthread_mutex_t ip_limits_lock = PTHREAD_MUTEX_INITIALIZER;
+ip_limit *ip_limits[IP_BUCKETS];
+int num_ip_limits = 0;
+
+// With -s, metrics are served on a UNIX socket by a thread of their own.
+const char *metrics_path = NULL;
+int metrics_fd = -1;
+pthread_t metrics_thread;
+double started_at;
+
+uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+double now_seconds() {
+    return now_ns() / 1e9;
+}
+
+/**
+ * Adds n to one of the calling shard's counters.
+ */
+void stat_add(atomic_long *counter, long n) {
+    atomic_store_explicit(counter, atomic_load_explicit(
+            counter, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+/**
+ * Counts a time in its histogram bucket.
+ */
+void stat_time(atomic_long *hist, uint64_t ns) {
+    uint64_t us = ns / 1000;
+    int i = us == 0 ? 0 : 64 - __builtin_clzll(us);
+    stat_add(&hist[i < HIST_BUCKETS ? i : HIST_BUCKETS - 1], 1);
+}
+
+/**
+ * Takes a token from b, which refills at rate per second up to 2 * rate.
+ * Returns false if it is empty.
+ */
+bool take_token(token_bucket *b, int rate, double now) {
+    b->tokens += (now - b->last) * rate;
+    if (b->tokens > 2.0 * rate) {
+        b->tokens = 2.0 * rate;
+    }
+    b->last = now;
+    if (b->tokens < 1) {
+        return false;
+    }
+    b->tokens--;
+    return true;
+}
+
+/**
+ * Marks a client to be disconnected once the current batch of events has
+ * been handled. Clients are never freed in the middle of a broadcast, which
+ * would reorder the array being walked.
+ */
+void close_client_later(client *c) {
+    if (c->closing) {
+        return;
+    }
+    c->closing = true;
+    shard *s = c->shard;
+    if (s->num_closing == s->closing_cap) {
+        int cap = s->closing_cap == 0 ? 64 : s->closing_cap * 2;
+        client **grown = realloc(s->closing, cap * sizeof(client *));
+        if (grown == NULL) {
+            fprintf(stderr, "Error: realloc() failed. %s.\n", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        s->closing = grown;
+        s->closing_cap = cap;
+    }
+    s->closing[s->num_closing++] = c;
+}
+
+/**
+ * Allocates a message holding a frame header for payload_len bytes. The
+ * caller fills in the payload and holds the only reference.
+ * Exits if memory could not be allocated.
+ */
+message *message_new(int type, size_t payload_len) {
+    message *m = malloc(sizeof(message) + FRAME_HEADER_LEN + payload_len);
+    if (m == NULL) {
+        fprintf(stderr, "Error: malloc() failed. %s.\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    atomic_init(&m->refs, 1);
+    m->created_ns = 0;
+    m->len = frame_header(m->data, type, payload_len) + payload_len;
+    return m;
+}
+
+void message_retain(message *m) {
+    atomic_fetch_add_explicit(&m->refs, 1, memory_order_relaxed);
+}
+
+void message_release(message *m) {
+    if (atomic_fetch_sub_explicit(&m->refs, 1, memory_order_acq_rel) == 1) {
+        free(m);
+    }
+}
+
+void inbox_init(inbox *q) {
+    atomic_init(&q->stub.next, NULL);
+    atomic_init(&q->head, &q->stub);
+    q->tail = &q->stub;
+}
+
+/**
+ * Adds a node to the inbox. Safe to call from any thread.
+ */
+void inbox_push(inbox *q, inbox_node *n) {
+    atomic_store_explicit(&n->next, NULL, memory_order_relaxed);
+    inbox_node *prev = atomic_exchange_explicit(&q->head, n,
+                                                memory_order_acq_rel);
+    atomic_store_explicit(&prev->next, n, memory_order_release);
+}
+
+/**
+ * Removes the oldest node. Only the owning shard may call this.
+ * Returns NULL if the inbox is empty, or if a producer is in the middle of
+ * a push; that producer will wake the owner again once it is done.
+ */
+inbox_node *inbox_pop(inbox *q) {
+    inbox_node *tail = q->tail;
+    inbox_node *next = atomic_load_explicit(&tail->next, memory_order_acquire);
+    if (tail == &q->stub) {
+        if (next == NULL) {
+            return NULL;
+        }
+        q->tail = next;
+        tail = next;
+        next = atomic_load_explicit(&tail->next, memory_order_acquire);
+    }
+    if (next != NULL) {
+        q->tail = next;
+        return tail;
+    }
+    if (tail != atomic_load_explicit(&q->head, memory_order_acquire)) {
+        return NULL;
+    }
+    inbox_push(q, &q->stub);
+    next = atomic_load_explicit(&tail->next, memory_order_acquire);
+    if (next != NULL) {
+        q->tail = next;
+        return tail;
+    }
+    return NULL;
+}
+
+/**
+ * Drops the first queued message of a client once it has been sent.
+ */
+void pop_message(client *c) {
+    message_release(c->out[c->out_head]);
+    c->out_head = (c->out_head + 1) % c->out_cap;
+    c->out_len--;
+    c->out_offset = 0;
+}
+
+/**
+ * Sends as much of a TLS client's queued messages as the socket will take.
+ * They are copied together into the shard's tls_buf, so each SSL_write()
+ * fills a record instead of sealing one per message. After a write that
+ * would block, OpenSSL must be given the same bytes again; the queue has
+ * not moved, so rebuilding the buffer from it starts with those bytes.
+ * Returns false if the connection failed.
+ */
+bool flush_tls_client(client *c) {
+    char *buf = c->shard->tls_buf;
+    while (c->out_len > 0) {
+        size_t len = 0;
+        for (int n = 0; n < c->out_len && len < TLS_RECORD_LEN; n++) {
+            message *m = c->out[(c->out_head + n) % c->out_cap];
+            size_t skip = n == 0 ? c->out_offset : 0;
+            size_t take = m->len - skip < TLS_RECORD_LEN - len
+                    ? m->len - skip : TLS_RECORD_LEN - len;
+            memcpy(buf + len, m->data + skip, take);
+            len += take;
+        }
+        ssize_t sent = tls_send(c->ssl, buf, len);
+        if (sent < 0) {
+            if (errno == EAGAIN) {
+                return true; // EPOLLOUT will tell us when to continue.
+            }
+            log_msg(LOG_WARNING, "Warning: Failed to send to [%s:%d]. %s.\n",
+                    c->ip, c->port, tls_strerror());
+            close_client_later(c);
+            return false;
+        }
+        c->out_bytes -= sent;
+        stat_add(&c->shard->stats.bytes_out, sent);
+        while (sent > 0) {
+            message *m = c->out[c->out_head];
+            if ((size_t)sent < m->len - c->out_offset) {
+                c->out_offset += sent;
+                break;
+            }
+            sent -= m->len - c->out_offset;
+            pop_message(c);
+            stat_add(&c->shard->stats.msgs_out, 1);
+        }
+    }
+    c->out_head = 0;
+    return true;
+}
+
+/**
+ * Sends as much of the client's queued messages as the socket will take,
+ * handing up to MAX_IOVECS of them to each sendmsg() call straight from the
+ * shared buffers.
+ * Returns false if the connection failed.
+ */
+bool flush_client(client *c) {
+    if (c->ssl != NULL) {
+        return c->handshaking || flush_tls_client(c);
+    }
+    while (c->out_len > 0) {
+        struct iovec iov[MAX_IOVECS];
+        int n = 0;
+        for (; n < c->out_len && n < MAX_IOVECS; n++) {
+            message *m = c->out[(c->out_head + n) % c->out_cap];
+            size_t skip = n == 0 ? c->out_offset : 0;
+            iov[n].iov_base = m->data + skip;
+            iov[n].iov_len = m->len - skip;
+        }
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = n;
+        ssize_t sent = sendmsg(c->fd, &msg, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return true; // EPOLLOUT will tell us when to continue.
+            }
+            log_msg(LOG_WARNING, "Warning: Failed to send to [%s:%d]. %s.\n",
+                    c->ip, c->port, strerror(errno));
+            close_client_later(c);
+            return false;
+        }
+        c->out_bytes -= sent;
+        stat_add(&c->shard->stats.bytes_out, sent);
+        for (int i = 0; i < n && sent > 0; i++) {
+            if ((size_t)sent < iov[i].iov_len) {
+                c->out_offset += sent;
+                break;
+            }
+            sent -= iov[i].iov_len;
+            pop_message(c);
+            stat_add(&c->shard->stats.msgs_out, 1);
+        }
+    }
+    c->out_head = 0;
+    return true;
+}
+
+/**
+ * Lists a TLS client to be flushed once the current batch of events has
+ * been handled.
+ */
+void flush_tls_later(client *c) {
+    shard *s = c->shard;
+    if (c->pending_index >= 0 || c->handshaking) {
+        return;
+    }
+    if (s->num_tls_pending == s->tls_pending_cap) {
+        int cap = s->tls_pending_cap == 0 ? 64 : s->tls_pending_cap * 2;
+        client **grown = realloc(s->tls_pending, cap * sizeof(client *));
+        if (grown == NULL) {
+            fprintf(stderr, "Error: realloc() failed. %s.\n", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        s->tls_pending = grown;
+        s->tls_pending_cap = cap;
+    }
+    c->pending_index = s->num_tls_pending;
+    s->tls_pending[s->num_tls_pending++] = c;
+}
+
+/**
+ * Takes a client off the shard's tls_pending, moving the last one into its
+ * place.
+ */
+void unlist_tls_client(client *c) {
+    shard *s = c->shard;
+    if (c->pending_index < 0) {
+        return;
+    }
+    client *last = s->tls_pending[--s->num_tls_pending];
+    s->tls_pending[c->pending_index] = last;
+    last->pending_index = c->pending_index;
+    c->pending_index = -1;
+}
+
+/**
+ * Flushes every TLS client listed by flush_tls_later().
+ */
+void flush_tls_clients(shard *s) {
+    while (s->num_tls_pending > 0) {
+        client *c = s->tls_pending[s->num_tls_pending - 1];
+        unlist_tls_client(c);
+        if (!c->closing) {
+            flush_tls_client(c);
+        }
+    }
+}
+
+/**
+ * Queues a reference to m for the client. If nothing is queued already, it
+ * is sent right away and only kept if the socket would not take all of it.
+ * Messages for a TLS client are always queued, and sent together after the
+ * current batch of events. A client whose backlog would exceed MAX_BACKLOG
+ * is not keeping up and is dropped, so it cannot make the server buffer
+ * without limit.
+ */
+void queue_message(client *c, message *m) {
+    if (c->closing) {
+        return;
+    }
+    size_t offset = 0;
+    if (c->ssl != NULL) {
+        flush_tls_later(c);
+    } else if (c->out_len == 0) {
+        ssize_t sent = send(c->fd, m->data, m->len, MSG_NOSIGNAL);
+        if (sent < 0 && errno != EAGAIN && errno != EWOULDBLOCK &&
+                errno != EINTR) {
+            log_msg(LOG_WARNING, "Warning: Failed to send to [%s:%d]. %s.\n",
+                    c->ip, c->port, strerror(errno));
+            close_client_later(c);
+            return;
+        }
+        offset = sent > 0 ? sent : 0;
+        stat_add(&c->shard->stats.bytes_out, offset);
+        if (offset == m->len) {
+            stat_add(&c->shard->stats.msgs_out, 1);
+            return;
+        }
+    }
+    if (c->out_bytes + m->len - offset > MAX_BACKLOG) {
+        stat_add(&c->shard->stats.dropped_slow, 1);
+        log_msg(LOG_INFO,
+                "Dropping slow client [%s:%d] with %zu bytes queued.\n",
+                c->ip, c->port, c->out_bytes);
+        close_client_later(c);
+        return;
+    }
+    if (c->out_len == c->out_cap) {
+        // Grow and straighten out the ring so it starts at 0.
+        int cap = c->out_cap == 0 ? 16 : c->out_cap * 2;
+        message **grown = malloc(cap * sizeof(message *));
+        if (grown == NULL) {
+            log_msg(LOG_ERROR, "Error: malloc() failed. %s.\n",
+                    strerror(errno));
+            close_client_later(c);
+            return;
+        }
+        for (int i = 0; i < c->out_len; i++) {
+            grown[i] = c->out[(c->out_head + i) % c->out_cap];
+        }
+        free(c->out);
+        c->out = grown;
+        c->out_cap = cap;
+        c->out_head = 0;
+    }
+    c->out[(c->out_head + c->out_len) % c->out_cap] = m;
+    c->out_len++;
+    if (c->out_len == 1) {
+        c->out_offset = offset;
+    }
+    c->out_bytes += m->len - offset;
+    message_retain(m);
+}
+
+/**
+ * Queues m for the shard's named clients except skip, then releases the
+ * caller's reference. The frame is encoded once and shared, not copied per
+ * client. To send the message to all clients, pass NULL for skip. Nothing
+ * here waits for a slow client: whatever it cannot take now is queued.
+ */
+void broadcast_message(shard *s, client *skip, message *m) {
+    for (int i = 0; i < s->num_connections; i++) {
+        if (s->clients[i] != skip) {
+            queue_message(s->clients[i], m);
+        }
+    }
+    message_release(m);
+}
+
+/**
+ * Wakes a shard blocked in epoll_wait() because its inbox has work. Only
+ * the first producer after the owner last checked writes to the eventfd.
+ */
+void wake_shard(shard *s) {
+    if (!atomic_exchange(&s->wakeup_pending, true)) {
+        uint64_t one = 1;
+        if (write(s->event_fd, &one, sizeof(one)) < 0) {
+            log_msg(LOG_WARNING, "Warning: Failed to wake shard %d. %s.\n",
+                    s->id, strerror(errno));
+        }
+    }
+}
 
-char inbuf[MAX_MSG_LEN + 1];
-char outbuf[BUFLEN + 1];
-char *usernames[MAX_CONNECTIONS];
+void room_retain(room *r) {
+    atomic_fetch_add_explicit(&r->refs, 1, memory_order_relaxed);
+}
+
+void room_release(room *r) {
+    if (atomic_fetch_sub_explicit(&r->refs, 1, memory_order_acq_rel) == 1) {
+        for (int i = 0; i < num_shards; i++) {
+            free(r->shards[i].members);
+        }
+        free(r->names);
+        free(r->name);
+        free(r);
+    }
+}
+
+/**
+ * Queues m for the members of room r on this shard except skip, then
+ * releases the caller's reference. For a chat message, the time from its
+ * arrival until it has been queued here goes in the fan-out histogram.
+ */
+void broadcast_room(shard *s, client *skip, room *r, message *m) {
+    room_shard *rs = &r->shards[s->id];
+    int n = atomic_load_explicit(&rs->num_members, memory_order_relaxed);
+    for (int i = 0; i < n; i++) {
+        if (rs->members[i] != skip) {
+            queue_message(rs->members[i], m);
+        }
+    }
+    if (m->created_ns != 0) {
+        stat_time(s->stats.fanout_us, now_ns() - m->created_ns);
+    }
+    message_release(m);
+}
+
+/**
+ * Broadcasts m to room r: each other shard with members in the room gets a
+ * reference through its inbox, and the local members except skip get it
+ * directly. Shards with nobody in the room are never woken.
+ */
+void publish_message(shard *s, client *skip, room *r, message *m) {
+    for (int i = 0; i < num_shards; i++) {
+        if (&shards[i] == s || atomic_load_explicit(
+                &r->shards[i].num_members, memory_order_relaxed) == 0) {
+            continue;
+        }
+        inbox_node *n = malloc(sizeof(inbox_node));
+        if (n == NULL) {
+            fprintf(stderr, "Error: malloc() failed. %s.\n", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        message_retain(m);
+        room_retain(r);
+        n->msg = m;
+        n->room = r;
+        inbox_push(&shards[i].inbox, n);
+        wake_shard(&shards[i]);
+    }
+    broadcast_room(s, skip, r, m);
+}
+
+/**
+ * Publishes a frame whose payload is a user name.
+ */
+void publish_name(shard *s, client *skip, room *r, int type,
+                  const char *name) {
+    size_t len = strlen(name);
+    message *m = message_new(type, len);
+    memcpy(m->data + FRAME_HEADER_LEN, name, len);
+    publish_message(s, skip, r, m);
+}
+
+/**
+ * Broadcasts everything other shards have sent since the last wakeup.
+ * wakeup_pending is cleared before the inbox is drained, so a push that
+ * is missed here always leads to another wakeup.
+ */
+void handle_inbox(shard *s) {
+    uint64_t count;
+    if (read(s->event_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        log_msg(LOG_WARNING, "Warning: Failed to read eventfd. %s.\n",
+                strerror(errno));
+    }
+    atomic_store(&s->wakeup_pending, false);
+    inbox_node *n;
+    while ((n = inbox_pop(&s->inbox)) != NULL) {
+        message *m = n->msg;
+        room *r = n->room;
+        free(n);
+        broadcast_room(s, NULL, r, m);
+        room_release(r);
+    }
+}
+
+/**
+ * Hashes a room name with djb2.
+ */
+unsigned int room_hash(const char *name) {
+    unsigned int hash = 5381;
+    for (const unsigned char *p = (const unsigned char *)name; *p; p++) {
+        hash = hash * 33 + *p;
+    }
+    return hash % ROOM_BUCKETS;
+}
+
+/**
+ * Returns the room with the given name, or NULL. directory_lock must be
+ * held.
+ */
+room *find_room(const char *name) {
+    for (room *r = rooms[room_hash(name)]; r != NULL; r = r->next) {
+        if (strcmp(r->name, name) == 0) {
+            return r;
+        }
+    }
+    return NULL;
+}
+
+void unlink_room(room *r) {
+    room **link = &rooms[room_hash(r->name)];
+    while (*link != r) {
+        link = &(*link)->next;
+    }
+    *link = r->next;
+}
+
+/**
+ * Returns the position of the first name in r's sorted names that is not
+ * less than name.
+ */
+int name_position(const room *r, const char *name) {
+    int lo = 0, hi = r->num_names;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (strcmp(r->names[mid], name) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/**
+ * Appends the names of r's members, which are already sorted, to end.
+ * r may be NULL for a room nobody is in. directory_lock must be held.
+ * Returns the new end of the text.
+ */
+char *format_members(char *end, const room *r) {
+    if (r == NULL || r->num_names == 0) {
+        return stpcpy(end, "\n\nNo other users are in the chat room.");
+    }
+    end = stpcpy(end, "\n\nConnected users: [");
+    end = stpcpy(end, r->names[0]);
+    for (int i = 1; i < r->num_names; i++) {
+        end = stpcpy(end, ", ");
+        end = stpcpy(end, r->names[i]);
+    }
+    return stpcpy(end, "]");
+}
+
+/**
+ * Creates a frame of the given type holding header and the list of users in
+ * room r. The caller holds directory_lock and the only reference.
+ */
+message *create_room_msg(int type, const char *header, const room *r) {
+    int num_names = r == NULL ? 0 : r->num_names;
+    message *msg = message_new(type, strlen(header) + 48 +
+                               num_names * (MAX_NAME_LEN + 2));
+    char *text = msg->data + FRAME_HEADER_LEN;
+    char *end = format_members(stpcpy(text, header), r);
+    msg->len = frame_header(msg->data, type, end - text) + (end - text);
+    return msg;
+}
+
+/**
+ * Creates a welcome frame that contains a welcome message as well as the
+ * list of users in the room new clients start out in. The caller holds the
+ * only reference.
+ */
+message *create_welcome_msg() {
+    // Names are only safe to read while the lock keeps their owners from
+    // leaving, so the whole message is built under it.
+    pthread_mutex_lock(&directory_lock);
+    message *msg = create_room_msg(FRAME_WELCOME,
+            "*** Welcome to CS 392 Chat Server v1.0 ***",
+            find_room(DEFAULT_ROOM));
+    pthread_mutex_unlock(&directory_lock);
+    return msg;
+}
+
+/**
+ * Returns the history of the named room, creating it if needed, or NULL if
+ * no more rooms can keep one.
+ */
+history *get_history(const char *name) {
+    pthread_mutex_lock(&histories_lock);
+    history *h = histories[room_hash(name)];
+    while (h != NULL && strcmp(h->name, name) != 0) {
+        h = h->next;
+    }
+    if (h == NULL && num_histories < MAX_HISTORIES &&
+            (h = calloc(1, sizeof(history))) != NULL) {
+        pthread_mutex_init(&h->lock, NULL);
+        strcpy(h->name, name);
+        h->next = histories[room_hash(name)];
+        histories[room_hash(name)] = h;
+        num_histories++;
+    }
+    pthread_mutex_unlock(&histories_lock);
+    return h;
+}
+
+/**
+ * Appends a record to the history file: the room name's length and the
+ * name, then the frame as sent. used in the header only counts whole
+ * records, so a crash mid-append loses at most that record. The file is
+ * compacted on every start, so it only grows by one run's worth of chat;
+ * past MAX_HISTORY_FILE, messages are no longer saved.
+ */
+void append_history_record(const char *name, const message *m) {
+    size_t name_len = strlen(name), need = 1 + name_len + m->len;
+    pthread_mutex_lock(&history_file_lock);
+    history_file_header *header = (history_file_header *)history_map;
+    size_t used = header->used;
+    if (used + need > history_map_len) {
+        size_t len = history_map_len * 2;
+        while (len < used + need) {
+            len *= 2;
+        }
+        if (len > MAX_HISTORY_FILE) {
+            if (!history_file_full) {
+                log_msg(LOG_WARNING, "Warning: History file is full. New "
+                        "messages are not saved until the server restarts."
+                        "\n");
+                history_file_full = true;
+            }
+            pthread_mutex_unlock(&history_file_lock);
+            return;
+        }
+        char *map;
+        if (ftruncate(history_fd, len) < 0 ||
+                (map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED,
+                            history_fd, 0)) == MAP_FAILED) {
+            log_msg(LOG_WARNING, "Warning: Failed to grow history file. %s.\n",
+                    strerror(errno));
+            pthread_mutex_unlock(&history_file_lock);
+            return;
+        }
+        munmap(history_map, history_map_len);
+        history_map = map;
+        history_map_len = len;
+        header = (history_file_header *)history_map;
+    }
+    char *p = history_map + used;
+    *p = (char)name_len;
+    memcpy(p + 1, name, name_len);
+    memcpy(p + 1 + name_len, m->data, m->len);
+    header->used = used + need;
+    pthread_mutex_unlock(&history_file_lock);
+}
+
+/**
+ * Adds a chat message to history h, dropping the oldest one if the ring is
+ * full, and saves it to the history file if there is one. h may be NULL for
+ * a room that keeps no history.
+ */
+void record_history(history *h, message *m) {
+    if (h == NULL) {
+        return;
+    }
+    message_retain(m);
+    pthread_mutex_lock(&h->lock);
+    message *oldest = NULL;
+    if (h->len == HISTORY_LEN) {
+        oldest = h->msgs[h->start];
+        h->start = (h->start + 1) % HISTORY_LEN;
+        h->len--;
+    }
+    h->msgs[(h->start + h->len++) % HISTORY_LEN] = m;
+    // Appending under the ring's lock keeps the file in the ring's order.
+    if (history_map != NULL) {
+        append_history_record(h->name, m);
+    }
+    pthread_mutex_unlock(&h->lock);
+    if (oldest != NULL) {
+        message_release(oldest);
+    }
+}
+
+/**
+ * Queues the recent messages of c's room for c, oldest first. They are
+ * references to frames already encoded, so the whole burst goes out in as
+ * few sendmsg() calls as the socket allows, and at most HISTORY_LEN frames
+ * are ever replayed.
+ */
+void replay_history(client *c) {
+    history *h = c->room->history;
+    if (h == NULL) {
+        return;
+    }
+    message *msgs[HISTORY_LEN];
+    pthread_mutex_lock(&h->lock);
+    int len = h->len;
+    for (int i = 0; i < len; i++) {
+        msgs[i] = h->msgs[(h->start + i) % HISTORY_LEN];
+        message_retain(msgs[i]);
+    }
+    pthread_mutex_unlock(&h->lock);
+    for (int i = 0; i < len; i++) {
+        queue_message(c, msgs[i]);
+        message_release(msgs[i]);
+    }
+}
+
+/**
+ * Opens the history file, creating it if needed, and loads the messages it
+ * holds into the rooms' histories. The file is then rewritten with only
+ * what the rings kept, so it never holds more than one run's worth of chat.
+ * Runs before any shard starts.
+ * Returns false on failure, after printing an error.
+ */
+bool open_history_file(const char *path) {
+    struct stat st;
+    if ((history_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644)) < 0 ||
+            fstat(history_fd, &st) < 0) {
+        fprintf(stderr, "Error: Cannot open history file '%s'. %s.\n", path,
+                strerror(errno));
+        return false;
+    }
+    // Check the header before the file is resized, so a file that is not a
+    // history file is left alone.
+    history_file_header check;
+    if (st.st_size > 0 &&
+            (pread(history_fd, &check, sizeof(check), 0) != sizeof(check) ||
+             memcmp(check.magic, HISTORY_MAGIC, sizeof(check.magic)) != 0 ||
+             check.used < sizeof(history_file_header) ||
+             check.used > (uint64_t)st.st_size)) {
+        fprintf(stderr, "Error: '%s' is not a history file.\n", path);
+        return false;
+    }
+    history_map_len = MIN_HISTORY_FILE;
+    while (history_map_len < (size_t)st.st_size) {
+        history_map_len *= 2;
+    }
+    if (ftruncate(history_fd, history_map_len) < 0 ||
+            (history_map = mmap(NULL, history_map_len, PROT_READ | PROT_WRITE,
+                                MAP_SHARED, history_fd, 0)) == MAP_FAILED) {
+        fprintf(stderr, "Error: Cannot map history file '%s'. %s.\n", path,
+                strerror(errno));
+        history_map = NULL;
+        return false;
+    }
+
+    history_file_header *header = (history_file_header *)history_map;
+    if (st.st_size == 0) {
+        memcpy(header->magic, HISTORY_MAGIC, sizeof(header->magic));
+        header->used = sizeof(history_file_header);
+        return true;
+    }
+
+    // Load every record into the rings, which keep the last HISTORY_LEN of
+    // each room. A damaged record ends the log.
+    size_t pos = sizeof(history_file_header), end = header->used;
+    char *map = history_map;
+    history_map = NULL;     // not saved again while loading
+    long loaded = 0;
+    while (pos < end) {
+        size_t name_len = (unsigned char)map[pos];
+        frame f;
+        char name[MAX_ROOM_LEN + 1];
+        if (name_len == 0 || name_len > MAX_ROOM_LEN ||
+                pos + 1 + name_len > end ||
+                frame_parse(map + pos + 1 + name_len,
+                            end - pos - 1 - name_len,
+                            MAX_NAME_LEN + 1 + MAX_MSG_LEN,
+                            &f) != FRAME_READY || f.type != FRAME_CHAT) {
+            fprintf(stderr, "Warning: History file '%s' is damaged after %ld "
+                    "messages.\n", path, loaded);
+            break;
+        }
+        memcpy(name, map + pos + 1, name_len);
+        name[name_len] = '\0';
+        history *h = get_history(name);
+        if (h != NULL) {
+            message *m = message_new(FRAME_CHAT, f.len);
+            memcpy(m->data + FRAME_HEADER_LEN, f.payload, f.len);
+            record_history(h, m);
+            message_release(m);
+            loaded++;
+        }
+        pos += 1 + name_len + FRAME_HEADER_LEN + f.len;
+    }
+
+    // Compact: write back only what the rings kept.
+    history_map = map;
+    header->used = sizeof(history_file_header);
+    for (int i = 0; i < ROOM_BUCKETS; i++) {
+        for (history *h = histories[i]; h != NULL; h = h->next) {
+            for (int j = 0; j < h->len; j++) {
+                append_history_record(h->name,
+                        h->msgs[(h->start + j) % HISTORY_LEN]);
+            }
+        }
+    }
+    printf("Loaded %ld messages from history file '%s'.\n", loaded, path);
+    return true;
+}
+
+/**
+ * Frees every history and closes the history file, trimmed to what it
+ * holds.
+ */
+void close_histories() {
+    for (int i = 0; i < ROOM_BUCKETS; i++) {
+        while (histories[i] != NULL) {
+            history *h = histories[i];
+            histories[i] = h->next;
+            for (int j = 0; j < h->len; j++) {
+                message_release(h->msgs[(h->start + j) % HISTORY_LEN]);
+            }
+            pthread_mutex_destroy(&h->lock);
+            free(h);
+        }
+    }
+    if (history_map != NULL) {
+        size_t used = ((history_file_header *)history_map)->used;
+        munmap(history_map, history_map_len);
+        if (ftruncate(history_fd, used) < 0) {
+            fprintf(stderr, "Warning: Failed to trim history file. %s.\n",
+                    strerror(errno));
+        }
+    }
+    if (history_fd >= 0) {
+        close(history_fd);
+    }
+}
+
+/**
+ * Adds c to the named room, creating the room if nobody is in it. If info
+ * is not NULL, it receives a FRAME_ROOM message listing the room's other
+ * members.
+ * Returns false if memory could not be allocated.
+ */
+bool enter_room(client *c, const char *name, message **info) {
+    room_shard *rs;
+    pthread_mutex_lock(&directory_lock);
+    room *r = find_room(name);
+    if (r == NULL) {
+        r = calloc(1, sizeof(room) + num_shards * sizeof(room_shard));
+        if (r == NULL || (r->name = strdup(name)) == NULL) {
+            free(r);
+            goto FAIL;
+        }
+        r->history = get_history(name);
+        r->next = rooms[room_hash(name)];
+        rooms[room_hash(name)] = r;
+    }
+    if (r->num_names == r->names_cap) {
+        int cap = r->names_cap == 0 ? 8 : r->names_cap * 2;
+        char **grown = realloc(r->names, cap * sizeof(char *));
+        if (grown == NULL) {
+            goto FAIL_ROOM;
+        }
+        r->names = grown;
+        r->names_cap = cap;
+    }
+    // Only this shard touches its members, but growing them here keeps every
+    // failure before the room changes.
+    rs = &r->shards[c->shard->id];
+    if (rs->num_members == rs->members_cap) {
+        int cap = rs->members_cap == 0 ? 8 : rs->members_cap * 2;
+        client **grown = realloc(rs->members, cap * sizeof(client *));
+        if (grown == NULL) {
+            goto FAIL_ROOM;
+        }
+        rs->members = grown;
+        rs->members_cap = cap;
+    }
+    if (info != NULL) {
+        char header[MAX_ROOM_LEN + 32];
+        sprintf(header, "*** Room '%s' ***", name);
+        *info = create_room_msg(FRAME_ROOM, header, r);
+    }
+
+    int pos = name_position(r, c->username);
+    memmove(r->names + pos + 1, r->names + pos,
+            (r->num_names - pos) * sizeof(char *));
+    r->names[pos] = c->username;
+    r->num_names++;
+    room_retain(r);
+    pthread_mutex_unlock(&directory_lock);
+
+    c->room = r;
+    c->room_index = rs->num_members;
+    rs->members[c->room_index] = c;
+    atomic_store_explicit(&rs->num_members, c->room_index + 1,
+                          memory_order_relaxed);
+    return true;
+
+FAIL_ROOM:
+    if (r->num_names == 0) {
+        unlink_room(r);
+        atomic_store(&r->refs, 1);
+        room_release(r);
+    }
+FAIL:
+    pthread_mutex_unlock(&directory_lock);
+    return false;
+}
+
+/**
+ * Removes c from its room. The room leaves the directory with its last
+ * member, and is freed once messages queued for it have been delivered.
+ */
+void exit_room(client *c) {
+    room *r = c->room;
+    if (r == NULL) {
+        return;
+    }
+    // Move the last member into the hole to keep the array dense.
+    room_shard *rs = &r->shards[c->shard->id];
+    int n = atomic_load_explicit(&rs->num_members, memory_order_relaxed) - 1;
+    client *last = rs->members[n];
+    rs->members[c->room_index] = last;
+    last->room_index = c->room_index;
+    atomic_store_explicit(&rs->num_members, n, memory_order_relaxed);
+
+    pthread_mutex_lock(&directory_lock);
+    // Names may repeat, so look for this client's own string among equals.
+    int pos = name_position(r, c->username);
+    while (r->names[pos] != c->username) {
+        pos++;
+    }
+    r->num_names--;
+    memmove(r->names + pos, r->names + pos + 1,
+            (r->num_names - pos) * sizeof(char *));
+    if (r->num_names == 0) {
+        unlink_room(r);
+    }
+    pthread_mutex_unlock(&directory_lock);
+    c->room = NULL;
+    room_release(r);
+}
 
-struct sockaddr_in server_addr;
-socklen_t addrlen = sizeof(struct sockaddr_in);
+void free_client(client *c) {
+    while (c->out_len > 0) {
+        pop_message(c);
+    }
+    SSL_free(c->ssl);
+    free(c->username);
+    free(c->out);
+    free(c);
+}
+
+/**
+ * Tells the shard's clients to close. Run by each shard as it stops; the
+ * sockets are closed by cleanup() once every shard has done this.
+ */
+void say_goodbye(shard *s) {
+    // Send "bye" to let all clients close before the server does. This is
+    // the last chance to flush, so whatever a socket will take now is all
+    // that client gets.
+    broadcast_message(s, NULL, message_new(FRAME_BYE, 0));
+    for (int i = 0; i < s->num_connections; i++) {
+        flush_client(s->clients[i]);
+    }
+}
+
+/**
+ * Forcefully closes all the sockets and frees up memory once the shards
+ * have stopped.
+ */
+void cleanup() {
+    // Give some time to allow the clients to close first. Otherwise, restarting
+    // the server immediately results in "Address already in use."
+    usleep(100000);
+    for (int i = 0; i < num_shards; i++) {
+        shard *s = &shards[i];
+        close(s->listen_fd);
+        close(s->epoll_fd);
+        close(s->event_fd);
+        // Clients still waiting for their name are only in clients_by_fd.
+        for (int fd = 0; fd < s->clients_by_fd_cap; fd++) {
+            if (s->clients_by_fd[fd] != NULL) {
+                close(fd);
+                free_client(s->clients_by_fd[fd]);
+            }
+        }
+        inbox_node *n;
+        while ((n = inbox_pop(&s->inbox)) != NULL) {
+            message_release(n->msg);
+            room_release(n->room);
+            free(n);
+        }
+        free(s->clients_by_fd);
+        free(s->clients);
+        free(s->closing);
+        free(s->tls_pending);
+    }
+    SSL_CTX_free(tls_ctx);
+    for (int i = 0; i < IP_BUCKETS; i++) {
+        while (ip_limits[i] != NULL) {
+            ip_limit *l = ip_limits[i];
+            ip_limits[i] = l->next;
+            free(l);
+        }
+    }
+    close_histories();
+    // The clients are gone, so the rooms still listed go with them.
+    for (int i = 0; i < ROOM_BUCKETS; i++) {
+        while (rooms[i] != NULL) {
+            room *r = rooms[i];
+            rooms[i] = r->next;
+            atomic_store(&r->refs, 1);
+            room_release(r);
+        }
+    }
+}
 
-volatile sig_atomic_t running = true;
+/**
+ * Marks a socket non-blocking. Edge-triggered epoll requires it, and no
+ * send() or recv() may ever wait on a single client.
+ */
+bool set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL);
+    return flags != -1 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) != -1;
+}
 
 /**
- * Signal handler.
+ * Adds a new connection to the shard's clients_by_fd, growing it by doubling
+ * as needed.
+ * Returns false if memory could not be allocated.
  */
-void catch_signal(int sig) {
-    running = false;
+bool add_connection(client *c) {
+    shard *s = c->shard;
+    if (c->fd >= s->clients_by_fd_cap) {
+        int cap = s->clients_by_fd_cap == 0 ? 64 : s->clients_by_fd_cap;
+        while (cap <= c->fd) {
+            cap *= 2;
+        }
+        client **grown = realloc(s->clients_by_fd, cap * sizeof(client *));
+        if (grown == NULL) {
+            return false;
+        }
+        memset(grown + s->clients_by_fd_cap, 0,
+               (cap - s->clients_by_fd_cap) * sizeof(client *));
+        s->clients_by_fd = grown;
+        s->clients_by_fd_cap = cap;
+    }
+    s->clients_by_fd[c->fd] = c;
+    return true;
 }
 
 /**
- * Prints a header with date/time information.
+ * Adds a client that has sent its name to the shard's dense array that
+ * the shard's broadcasts walk, growing it by doubling as needed.
+ * Returns false if memory could not be allocated.
  */
-void print_date_time_header(FILE *output) {
-    time_t t = time(NULL);
-    struct tm *tm = localtime(&t);
-    char s[64];
-    strftime(s, sizeof(s), "%c", tm);
-    fprintf(output, "%s: ", s);
+bool add_named_client(client *c) {
+    shard *s = c->shard;
+    if (s->num_connections == s->clients_cap) {
+        int cap = s->clients_cap == 0 ? 64 : s->clients_cap * 2;
+        client **grown = realloc(s->clients, cap * sizeof(client *));
+        if (grown == NULL) {
+            return false;
+        }
+        s->clients = grown;
+        s->clients_cap = cap;
+    }
+    c->index = s->num_connections;
+    s->clients[s->num_connections++] = c;
+    c->state = CLIENT_ACTIVE;
+    return true;
 }
 
 /**
- * Broadcasts the contents of the buffer to all sockets except skip_index.
- * To send the message to all clients, pass -1 for skip_index.
+ * Forgets the addresses whose buckets have filled up again, which are as
+ * good as new. Called with ip_limits_lock held when the table is full.
  */
-void broadcast_buffer(int skip_index, char *buf) {
-    for (int i = 0; i < MAX_CONNECTIONS; i++) {
-        if (i != skip_index && client_sockets[i] != -1) {
-            if (send(client_sockets[i], buf, strlen(buf), 0) == -1) {
-                printf("%d\n", client_sockets[i]);
-                print_date_time_header(stderr);
-                fprintf(stderr,
-                    "Warning: Failed to broadcast message. %s.\n",
-                    strerror(errno));
+void forget_idle_ips(double now) {
+    for (int i = 0; i < IP_BUCKETS; i++) {
+        ip_limit **p = &ip_limits[i];
+        while (*p != NULL) {
+            ip_limit *l = *p;
+            if (l->bucket.tokens + (now - l->bucket.last) * ip_rate >=
+                    2.0 * ip_rate) {
+                *p = l->next;
+                free(l);
+                num_ip_limits--;
+            } else {
+                p = &l->next;
             }
         }
     }
 }
 
 /**
- * String comparator for qsort.
+ * Applies the connection rate limit of a source address. The limits are
+ * shared by all shards, since the kernel spreads one address's connections
+ * across them.
+ * Returns false if the connection should be refused.
+ */
+bool admit_ip(in_addr_t ip, double now) {
+    if (ip_rate == 0) {
+        return true;
+    }
+    unsigned int i = ((uint32_t)ip * 2654435761u) % IP_BUCKETS;
+    pthread_mutex_lock(&ip_limits_lock);
+    ip_limit *l = ip_limits[i];
+    while (l != NULL && l->ip != ip) {
+        l = l->next;
+    }
+    if (l == NULL) {
+        if (num_ip_limits >= MAX_TRACKED_IPS) {
+            forget_idle_ips(now);
+        }
+        if (num_ip_limits < MAX_TRACKED_IPS &&
+                (l = malloc(sizeof(ip_limit))) != NULL) {
+            l->ip = ip;
+            l->bucket.tokens = 2.0 * ip_rate;
+            l->bucket.last = now;
+            l->next = ip_limits[i];
+            ip_limits[i] = l;
+            num_ip_limits++;
+        }
+    }
+    bool admitted = l != NULL && take_token(&l->bucket, ip_rate, now);
+    pthread_mutex_unlock(&ip_limits_lock);
+    return admitted;
+}
+
+/**
+ * Returns when the client times out, or -1 if it never does. A client must
+ * send its name within NAME_TIMEOUT seconds of connecting, however much it
+ * sends before that, and a named one may stay silent for idle_timeout.
  */
-int str_cmp(const void *a, const void *b) { 
-    return strcmp(*(const char**)a, *(const char**)b);
+double client_deadline(const client *c) {
+    if (c->state == CLIENT_AWAIT_NAME) {
+        return c->connected_at + NAME_TIMEOUT;
+    }
+    return idle_timeout > 0 ? c->last_active + idle_timeout : -1;
 }
 
 /**
- * Creates a string in outbuf that contains a welcome message as well as the
- * list of all users currently connected to the server.
+ * Puts a client in the wheel slot of the first second after its deadline.
  */
-void create_welcome_msg() {
-    outbuf[0] = '\0'; // Don't forget to start from the beginning!
-    strcat(outbuf, "*** Welcome to CS 392 Chat Server v1.0 ***");
-    if (num_connections == 0) {
-        strcat(outbuf, "\n\nNo other users are in the chat room.");
+void schedule_timeout(client *c, double deadline) {
+    shard *s = c->shard;
+    int slot = ((long)deadline + 1) % WHEEL_SLOTS;
+    c->timer_slot = slot;
+    c->timer_prev = NULL;
+    c->timer_next = s->wheel[slot];
+    if (c->timer_next != NULL) {
+        c->timer_next->timer_prev = c;
+    }
+    s->wheel[slot] = c;
+}
+
+void cancel_timeout(client *c) {
+    if (c->timer_slot < 0) {
         return;
     }
-    char *names[MAX_CONNECTIONS];
-    int j = 0;
-    for (int i = 0; i < MAX_CONNECTIONS; i++) {
-        if (usernames[i]) {
-            names[j++] = usernames[i];
-        }
+    if (c->timer_prev != NULL) {
+        c->timer_prev->timer_next = c->timer_next;
+    } else {
+        c->shard->wheel[c->timer_slot] = c->timer_next;
     }
-    qsort(names, j, sizeof(char *), str_cmp);
-    strcat(outbuf, "\n\nConnected users: [");
-    strcat(outbuf, names[0]);
-    for (int i = 1; i < j; i++) {
-        strcat(outbuf, ", ");
-        strcat(outbuf, names[i]);
+    if (c->timer_next != NULL) {
+        c->timer_next->timer_prev = c->timer_prev;
     }
-    strcat(outbuf, "]");
+    c->timer_slot = -1;
 }
 
 /**
- * Tells the clients to close before forcefully closing all the sockets and
- * freeing up memory.
+ * Moves a client to the slot of its current deadline, which may be earlier
+ * than the one it is in, as when a named client has a short idle timeout.
  */
-void cleanup() {
-    // Send "bye" to let all clients close before the server does.
-    sprintf(outbuf, "bye");
-    broadcast_buffer(-1, outbuf);
-    // Give some time to allow the clients to close first. Otherwise, restarting
-    // the server immediately results in "Address already in use."
-    usleep(100000);
-    // F_GETFD - Return the file descriptor flags.
-    if (fcntl(server_socket, F_GETFD) >= 0) {
-        close(server_socket);
+void reset_timeout(client *c) {
+    cancel_timeout(c);
+    double deadline = client_deadline(c);
+    if (deadline >= 0) {
+        schedule_timeout(c, deadline);
+    }
+}
+
+/**
+ * Handles the wheel slots of the seconds that have passed. Activity does not
+ * move a client in the wheel, which would cost a relink per message;
+ * instead a client whose slot comes up is put back for its new deadline if
+ * it has been active since.
+ */
+void run_timers(shard *s) {
+    long now = (long)s->now;
+    if (now - s->wheel_tick > WHEEL_SLOTS) {
+        s->wheel_tick = now - WHEEL_SLOTS;
     }
-    for (int i = 0; i < MAX_CONNECTIONS; i++) {
-        if (fcntl(client_sockets[i], F_GETFD) >= 0) {
-            close(client_sockets[i]);
+    while (s->wheel_tick < now) {
+        int slot = ++s->wheel_tick % WHEEL_SLOTS;
+        client *c = s->wheel[slot];
+        s->wheel[slot] = NULL;
+        while (c != NULL) {
+            client *next = c->timer_next;
+            c->timer_slot = -1;
+            double deadline = client_deadline(c);
+            if (deadline >= 0 && deadline <= s->now && !c->closing) {
+                stat_add(&s->stats.timed_out, 1);
+                log_msg(LOG_INFO, "Host [%s:%d] timed out.\n", c->ip,
+                        c->port);
+                close_client_later(c);
+            } else if (deadline >= 0 && !c->closing) {
+                schedule_timeout(c, deadline);
+            }
+            c = next;
         }
-        if (usernames[i]) {
-            free(usernames[i]);
+    }
+}
+
+/**
+ * Samples the backlogs of the shard's named clients for the metrics.
+ */
+void sample_queues(shard *s) {
+    long clients = 0, msgs = 0, bytes = 0, max_bytes = 0;
+    for (int i = 0; i < s->num_connections; i++) {
+        client *c = s->clients[i];
+        if (c->out_len > 0) {
+            clients++;
+            msgs += c->out_len;
+            bytes += c->out_bytes;
+            max_bytes = (long)c->out_bytes > max_bytes ? (long)c->out_bytes
+                                                       : max_bytes;
         }
     }
+    atomic_store_explicit(&s->stats.queued_clients, clients,
+                          memory_order_relaxed);
+    atomic_store_explicit(&s->stats.queued_msgs, msgs, memory_order_relaxed);
+    atomic_store_explicit(&s->stats.queued_bytes, bytes,
+                          memory_order_relaxed);
+    atomic_store_explicit(&s->stats.max_queued_bytes, max_bytes,
+                          memory_order_relaxed);
 }
 
 /**
  * Disconnects a client from the server, freeing up resources to be used by
  * another potential client.
  */
-void disconnect_client(int index, char *ip, int port) {
-    print_date_time_header(stdout);
-    printf("Host [%s:%d] disconnected.\n", ip, port);
+void disconnect_client(client *c) {
+    shard *s = c->shard;
+    log_msg(LOG_INFO, "Host [%s:%d] disconnected.\n", c->ip, c->port);
+
+    if (c->state == CLIENT_ACTIVE) {
+        // Move the last client into the hole to keep the array dense.
+        client *last = s->clients[--s->num_connections];
+        s->clients[c->index] = last;
+        last->index = c->index;
 
-    sprintf(outbuf, "User [%s] left the chat room.", usernames[index]);
-    broadcast_buffer(index, outbuf);
+        // A client whose room could not be entered, for lack of memory,
+        // is active but in no room.
+        if (c->room != NULL) {
+            publish_name(s, c, c->room, FRAME_LEAVE, c->username);
+            exit_room(c);
+        }
+    }
 
-    // Close the socket and mark the array index as -1 for reuse.
-    close(client_sockets[index]);
-    client_sockets[index] = -1;
-    // Free up the usernames index and mark the array index as NULL for reuse.
-    free(usernames[index]);
-    usernames[index] = NULL;
-    // Keep track of the number of connections.
-    num_connections--;
+    unlist_tls_client(c);
+    cancel_timeout(c);
+    // Closing the socket also removes it from the epoll set.
+    close(c->fd);
+    s->clients_by_fd[c->fd] = NULL;
+    atomic_fetch_sub(&num_sockets, 1);
+    stat_add(&s->stats.connections, -1);
+    free_client(c);
 }
 
 /**
- * Handles an incoming connection.
- * Performs the tasks required to accept the connection and add the client
- * to the system.
+ * Disconnects every client marked by close_client_later(). Each departure
+ * is broadcast, which can mark more clients, so the count is re-read.
  */
-int handle_server_socket() {
-    // Try to accept incoming connection.
-    int new_socket = accept(server_socket,
-                            (struct sockaddr *)&server_addr,
-                            &addrlen);
-    if (new_socket < 0 && errno != EINTR) {   
-        fprintf(stderr,
-                "Error: Failed to accept incoming connection. %s.\n",
-                strerror(errno));
-        return EXIT_FAILURE;
-    }   
-
-    // If the server is maxed out, refuse the connection.
-    if (num_connections >= MAX_CONNECTIONS) {
-        print_date_time_header(stdout);
-        printf("Connection from [%s:%d] refused.\n",
-               inet_ntoa(server_addr.sin_addr),
-               ntohs(server_addr.sin_port));
+void close_marked_clients(shard *s) {
+    for (int i = 0; i < s->num_closing; i++) {
+        disconnect_client(s->closing[i]);
+    }
+    s->num_closing = 0;
+}
+
+/**
+ * Handles one incoming connection: queues the welcome message and registers
+ * the socket with the shard that accepted it. The client's name arrives
+ * later, like any other data.
+ */
+void accept_client(shard *s, int new_socket, struct sockaddr_in *addr) {
+    char ip[INET_ADDRSTRLEN], connection_str[24];
+    inet_ntop(AF_INET, &addr->sin_addr, ip, sizeof(ip));
+    sprintf(connection_str, "[%s:%d]", ip, ntohs(addr->sin_port));
+
+    // If the address is connecting too often, or the server is maxed out,
+    // refuse the connection before spending anything on it.
+    if (!admit_ip(addr->sin_addr.s_addr, s->now)) {
+        stat_add(&s->stats.refused, 1);
+        log_msg(LOG_INFO, "Connection from %s refused, over its rate "
+                "limit.\n", connection_str);
+        close(new_socket);
+        return;
+    }
+    if (atomic_fetch_add(&num_sockets, 1) >= MAX_CONNECTIONS) {
+        atomic_fetch_sub(&num_sockets, 1);
+        stat_add(&s->stats.refused, 1);
+        log_msg(LOG_INFO, "Connection from %s refused.\n", connection_str);
         close(new_socket);
-        return EXIT_SUCCESS; // Not a failure, just a limitation.
+        return; // Not a failure, just a limitation.
     }
 
-    char connection_str[24];
-    sprintf(connection_str, "[%s:%d]", inet_ntoa(server_addr.sin_addr),
-            ntohs(server_addr.sin_port));
     // Log information about the client's connection.
-    print_date_time_header(stdout);
-    printf("New connection from %s.\n", connection_str);
-   
-    // Send a welcome message to the new connection.
-    create_welcome_msg();
-    if (send(new_socket, outbuf, strlen(outbuf), 0) == -1 && errno != EINTR) {
-        print_date_time_header(stderr);
-        fprintf(stderr,
-                "Warning: Failed to send welcome message. %s.\n",
-                strerror(errno));
-    } else {
-        print_date_time_header(stdout);
-        printf("Welcome message sent to %s.\n", connection_str);
+    log_msg(LOG_INFO, "New connection from %s.\n", connection_str);
+
+    client *c = calloc(1, sizeof(client));
+    if (c == NULL) {
+        log_msg(LOG_ERROR, "Error: calloc() failed. %s.\n", strerror(errno));
+        atomic_fetch_sub(&num_sockets, 1);
+        close(new_socket);
+        return;
     }
+    c->shard = s;
+    c->fd = new_socket;
+    c->index = -1;
+    c->pending_index = -1;
+    c->timer_slot = -1;
+    c->connected_at = c->last_active = c->messages.last = s->now;
+    c->messages.tokens = 2.0 * msg_rate;
+    c->state = CLIENT_AWAIT_NAME;
+    strcpy(c->ip, ip);
+    c->port = ntohs(addr->sin_port);
+    // EPOLLOUT is edge-triggered too, so it only fires when a full socket
+    // drains, and the registration never has to change.
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    event.data.fd = new_socket;
+    if (!set_nonblocking(new_socket) ||
+            (tls_ctx != NULL &&
+             (c->ssl = tls_new(tls_ctx, new_socket, NULL)) == NULL) ||
+            epoll_ctl(s->epoll_fd, EPOLL_CTL_ADD, new_socket, &event) == -1 ||
+            !add_connection(c)) {
+        log_msg(LOG_WARNING, "Warning: Failed to add client %s. %s.\n",
+                connection_str, strerror(errno));
+        free_client(c);
+        atomic_fetch_sub(&num_sockets, 1);
+        close(new_socket);
+        return;
+    }
+    stat_add(&s->stats.connections, 1);
+
+    reset_timeout(c);
 
-    // Receive the user name from the client.
-    int bytes_recvd = recv(new_socket, inbuf, MAX_MSG_LEN + 1, 0);
-    if (bytes_recvd == -1) {
-        print_date_time_header(stderr);
-        fprintf(stderr, "Warning: Failed to receive user name. %s.\n",
+    // Queue a welcome message for the new connection. Over TLS, it waits
+    // for the handshake, which runs as the client's data arrives.
+    c->handshaking = c->ssl != NULL;
+    message *welcome = create_welcome_msg();
+    if (welcome == NULL) {
+        log_msg(LOG_WARNING, "Warning: Failed to send welcome message. %s.\n",
                 strerror(errno));
-    } else if (bytes_recvd == 0) {
-        return EXIT_SUCCESS; // Client hung up prematurely.
     } else {
-        inbuf[bytes_recvd] = '\0';
-        print_date_time_header(stdout);
-        printf("Associated user name '%s' with %s.\n", inbuf, connection_str);
+        queue_message(c, welcome);
+        message_release(welcome);
+        log_msg(LOG_INFO, "Welcome message sent to %s.\n", connection_str);
     }
+}
 
-    // Add new socket to array of sockets.
-    for (int i = 0; i < MAX_CONNECTIONS; i++) {   
-        if (client_sockets[i] == -1) {
-            client_sockets[i] = new_socket;
-            usernames[i] = strdup(inbuf);
-            num_connections++;
-            sprintf(outbuf, "User [%s] joined the chat room.", usernames[i]);
-            broadcast_buffer(i, outbuf);
-            break;   
-        }   
+/**
+ * Accepts connections waiting on the shard's listening socket, at most
+ * MAX_ACCEPTS per wakeup. The socket is edge-triggered, so if more may be
+ * waiting, accepts_pending makes the loop come back without waiting for
+ * epoll.
+ */
+int handle_server_socket(shard *s) {
+    s->accepts_pending = false;
+    for (int i = 0; i < MAX_ACCEPTS; i++) {
+        struct sockaddr_in addr;
+        socklen_t len = sizeof(addr);
+        int new_socket = accept(s->listen_fd, (struct sockaddr *)&addr, &len);
+        if (new_socket < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return EXIT_SUCCESS;
+            }
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            if (errno == EMFILE || errno == ENFILE) {
+                // Out of descriptors: leave the rest queued in the kernel.
+                log_msg(LOG_WARNING, "Warning: Failed to accept incoming "
+                        "connection. %s.\n", strerror(errno));
+                return EXIT_SUCCESS;
+            }
+            log_msg(LOG_ERROR,
+                    "Error: Failed to accept incoming connection. %s.\n",
+                    strerror(errno));
+            return EXIT_FAILURE;
+        }
+        accept_client(s, new_socket, &addr);
     }
-
+    s->accepts_pending = true;
     return EXIT_SUCCESS;
 }
 
 /**
- * Handles data received from a client.
- * Based on the data received, the function either disconnects the client or
- * broadcasts the client's message to all other clients on the system.
+ * Handles the join frame, which must be the first frame from a client, and
+ * moves it from CLIENT_AWAIT_NAME to CLIENT_ACTIVE.
  */
-void handle_client_socket(int index) {
-    int port = 0;
-    char ip[16];
+void handle_user_name(client *c, const frame *f) {
+    if (f->type != FRAME_JOIN || f->len == 0 || f->len > MAX_NAME_LEN ||
+            memchr(f->payload, '\0', f->len) != NULL) {
+        log_msg(LOG_WARNING, "Warning: Invalid user name from [%s:%d].\n",
+                c->ip, c->port);
+        close_client_later(c);
+        return;
+    }
+    if ((c->username = strndup(f->payload, f->len)) == NULL ||
+            !add_named_client(c) || !enter_room(c, DEFAULT_ROOM, NULL)) {
+        log_msg(LOG_ERROR, "Error: malloc() failed. %s.\n", strerror(errno));
+        close_client_later(c);
+        return;
+    }
+    log_msg(LOG_INFO, "Associated user name '%s' with [%s:%d].\n",
+            c->username, c->ip, c->port);
+    reset_timeout(c);
+    replay_history(c);
+    publish_name(c->shard, c, c->room, FRAME_JOIN, c->username);
+}
 
-    if (getpeername(client_sockets[index], (struct sockaddr*)&server_addr,
-                    &addrlen) == 0) {
-        inet_ntop(AF_INET, &(server_addr.sin_addr), ip, 16);
-        port = ntohs(server_addr.sin_port);
+/**
+ * Handles a room frame: moves the client to the named room, or back to
+ * DEFAULT_ROOM if the name is empty, and tells it who is there.
+ */
+void handle_room(client *c, const frame *f) {
+    char name[MAX_ROOM_LEN + 1];
+    if (f->len > MAX_ROOM_LEN || memchr(f->payload, '\0', f->len) != NULL) {
+        log_msg(LOG_WARNING, "Warning: Invalid room name from [%s:%d].\n",
+                c->ip, c->port);
+        close_client_later(c);
+        return;
+    }
+    if (f->len == 0) {
+        strcpy(name, DEFAULT_ROOM);
     } else {
-         // Set string to 0.0.0.0 if getpeername fails.
-         // We don't really want to error out for this reason alone.
-         // It should never happen, anyway.
-        sprintf(ip, "0.0.0.0");
+        memcpy(name, f->payload, f->len);
+        name[f->len] = '\0';
     }
 
-    // Read the incoming message and use the number of bytes read to
-    // check if the client disconnected.
-    int bytes_recvd = recv(client_sockets[index], inbuf, MAX_MSG_LEN + 1, 0);
-    if (bytes_recvd == -1 && errno != EINTR) {
-        print_date_time_header(stderr);
-        fprintf(stderr,
-                "Warning: Failed to receive incoming message from "
-                "[%s:%d]. %s.\n", ip, port, strerror(errno));
-    } else if (bytes_recvd == 0) {
-        // The client disconnected.
-        disconnect_client(index, ip, port);
-    } else {
-        // Process the incoming data. If "bye", the client disconnected.
-        // Otherwise, broadcast the message to all the other users.
-        inbuf[bytes_recvd] = '\0';
-        print_date_time_header(stdout);
-        printf("Received from '%s' at [%s:%d]: %s\n", usernames[index],
-               ip, port, inbuf);
-        if (strcmp(inbuf, "bye") == 0) {
-            disconnect_client(index, ip, port);
-        } else {
-            sprintf(outbuf, "[%s]: %s", usernames[index], inbuf);
-            broadcast_buffer(index, outbuf);
-        }
+    publish_name(c->shard, c, c->room, FRAME_LEAVE, c->username);
+    exit_room(c);
+    message *info;
+    if (!enter_room(c, name, &info)) {
+        log_msg(LOG_ERROR, "Error: malloc() failed. %s.\n", strerror(errno));
+        close_client_later(c);
+        return;
     }
+    if (info != NULL) {
+        queue_message(c, info);
+        message_release(info);
+    }
+    replay_history(c);
+    log_msg(LOG_INFO, "User '%s' at [%s:%d] moved to room '%s'.\n",
+            c->username, c->ip, c->port, name);
+    publish_name(c->shard, c, c->room, FRAME_JOIN, c->username);
 }
 
 /**
- * Main function.
- * Initializes variables, runs the main loop, and cleans up.
+ * Handles one complete frame from a client.
+ * Based on its type, the function either disconnects the client, moves it
+ * to another room, or broadcasts the client's message to the other clients
+ * in its room.
  */
-int main(int argc, char *argv[]) {
-    int retval = EXIT_SUCCESS;
- 
-    // Parse command line argument for port number.
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s <port number>\n", argv[0]);
-        return EXIT_FAILURE;
+void handle_frame(client *c, const frame *f) {
+    stat_add(&c->shard->stats.msgs_in, 1);
+    if (c->state == CLIENT_AWAIT_NAME) {
+        handle_user_name(c, f);
+        return;
     }
-    int port;   
-    if (!parse_int(argv[1], &port, "port number")) {
-        return EXIT_FAILURE;
+    if (f->type == FRAME_BYE) {
+        close_client_later(c);
+        return;
     }
-    if (port < 1024 || port > 65535) {
-        fprintf(stderr, "Error: port must be in range [1024, 65535].\n");
-        return EXIT_FAILURE;
+    // Chat and room frames cost the server a broadcast, so they are shed
+    // once the client is over its rate; the connection itself is kept.
+    if (msg_rate > 0 && !take_token(&c->messages, msg_rate, c->shard->now)) {
+        stat_add(&c->shard->stats.shed_messages, 1);
+        if (!c->throttled) {
+            c->throttled = true;
+            log_msg(LOG_INFO, "User '%s' at [%s:%d] is over its message "
+                    "rate. Dropping messages.\n", c->username, c->ip,
+                    c->port);
+        }
+        return;
+    }
+    c->throttled = false;
+    if (f->type == FRAME_ROOM) {
+        handle_room(c, f);
+        return;
+    }
+    if (f->type != FRAME_CHAT) {
+        log_msg(LOG_WARNING,
+                "Warning: Unexpected frame type %d from [%s:%d].\n",
+                f->type, c->ip, c->port);
+        close_client_later(c);
+        return;
     }
+    log_msg(LOG_DEBUG, "Received from '%s' at [%s:%d]: %.*s\n", c->username,
+            c->ip, c->port, (int)f->len, f->payload);
+    // The chat frame sent on is the sender's name, a NUL, then the text.
+    size_t name_len = strlen(c->username);
+    message *m = message_new(FRAME_CHAT, name_len + 1 + f->len);
+    char *p = m->data + FRAME_HEADER_LEN;
+    memcpy(p, c->username, name_len + 1);
+    memcpy(p + name_len + 1, f->payload, f->len);
+    m->created_ns = now_ns();
+    record_history(c->room->history, m);
+    publish_message(c->shard, c, c->room, m);
+}
 
-    // Set up a signal handler for SIGINT, CTRL+C.
-    struct sigaction action;
-    memset(&action, 0, sizeof(struct sigaction));
-    action.sa_handler = catch_signal;
-    if (sigaction(SIGINT, &action, NULL) == -1) {
-        fprintf(stderr, "Error: Failed to register signal handler. %s.\n",
-                strerror(errno));
-        return EXIT_FAILURE;
+/**
+ * Handles data received from a client.
+ * The socket is edge-triggered, so it is read until it would block. Bytes
+ * are appended to the client's buffer, and every complete frame in it is
+ * handled, however the sender's writes were split or merged on the way.
+ */
+void handle_client_socket(client *c) {
+    while (!c->closing) {
+        // Read the incoming data and use the number of bytes read to
+        // check if the client disconnected.
+        ssize_t bytes_recvd = c->ssl != NULL
+                ? tls_recv(c->ssl, c->in + c->in_len, sizeof(c->in) - c->in_len)
+                : recv(c->fd, c->in + c->in_len, sizeof(c->in) - c->in_len, 0);
+        if (bytes_recvd == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                log_msg(LOG_WARNING, "Warning: Failed to receive incoming "
+                        "message from [%s:%d]. %s.\n", c->ip, c->port,
+                        strerror(errno));
+                close_client_later(c);
+            }
+            return;
+        } else if (bytes_recvd == 0) {
+            // The client disconnected.
+            close_client_later(c);
+            return;
+        }
+        c->in_len += bytes_recvd;
+        stat_add(&c->shard->stats.bytes_in, bytes_recvd);
+        c->last_active = c->shard->now;
+
+        size_t used = 0;
+        frame f;
+        int status = FRAME_INCOMPLETE;
+        while (!c->closing &&
+                (status = frame_parse(c->in + used, c->in_len - used,
+                                      MAX_MSG_LEN, &f)) == FRAME_READY) {
+            handle_frame(c, &f);
+            used += FRAME_HEADER_LEN + f.len;
+        }
+        if (status == FRAME_INVALID) {
+            log_msg(LOG_WARNING, "Warning: Invalid frame from [%s:%d].\n",
+                    c->ip, c->port);
+            close_client_later(c);
+            return;
+        }
+        // Keep the start of an incomplete frame for the next read.
+        memmove(c->in, c->in + used, c->in_len - used);
+        c->in_len -= used;
+    }
+}
+
+/**
+ * Moves a TLS client's handshake on. Once it is done, the welcome message
+ * queued at accept time goes out, and whatever the client sent along with
+ * its last handshake message is read.
+ */
+void handle_handshake(client *c) {
+    int done = tls_handshake(c->ssl);
+    if (done < 0) {
+        log_msg(LOG_WARNING, "Warning: TLS handshake with [%s:%d] failed. "
+                "%s.\n", c->ip, c->port, tls_strerror());
+        close_client_later(c);
+        return;
+    }
+    if (done == 0) {
+        return;
     }
+    c->handshaking = false;
+    log_msg(LOG_INFO, "TLS handshake with [%s:%d] done, %s, %s.\n", c->ip,
+            c->port, SSL_get_version(c->ssl),
+            SSL_session_reused(c->ssl) ? "resumed" : "new session");
+    flush_tls_later(c);
+    handle_client_socket(c);
+}
+
+/**
+ * Runs one shard's event loop until the server shuts down. A fatal error
+ * stops the whole server by raising SIGINT, which main() is waiting for.
+ */
+void *run_shard(void *arg) {
+    shard *s = (shard *)arg;
+    struct epoll_event events[MAX_EVENTS];
+    while (atomic_load(&running)) {
+        // Wait for activity on one of the sockets or the inbox, but no more
+        // than a second, the resolution of the timer wheel, and not at all
+        // if connections are still waiting to be accepted.
+        int num_events = epoll_wait(s->epoll_fd, events, MAX_EVENTS,
+                                    s->accepts_pending ? 0 : 1000);
+        uint64_t woke_ns = now_ns();
+        s->now = woke_ns / 1e9;
+        if (num_events < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            log_msg(LOG_ERROR, "Error: epoll_wait() failed. %s.\n",
+                    strerror(errno));
+            goto FAIL;
+        }
 
-    // Initialize all client sockets to -1 and usernames to NULL.
-    for (int i = 0; i < MAX_CONNECTIONS; i++) {
-        client_sockets[i] = -1;
-        usernames[i] = NULL;
+        for (int i = 0; i < num_events; i++) {
+            int fd = events[i].data.fd;
+            // If there is activity on the listening socket, the incoming
+            // connections are handled once the connected clients have been.
+            if (fd == s->listen_fd) {
+                s->accepts_pending = true;
+                continue;
+            }
+            if (fd == s->event_fd) {
+                handle_inbox(s);
+                continue;
+            }
+            client *c = fd < s->clients_by_fd_cap ? s->clients_by_fd[fd] : NULL;
+            if (c == NULL || c->closing) {
+                continue;
+            }
+            if (c->handshaking) {
+                handle_handshake(c);
+                continue;
+            }
+            if (events[i].events & EPOLLOUT) {
+                flush_client(c);
+            }
+            // A TLS read may have waited for the socket to drain, so a TLS
+            // client is read on either event.
+            int readable = EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR;
+            if ((events[i].events & readable) || c->ssl != NULL) {
+                handle_client_socket(c);
+            }
+        }
+        if (s->accepts_pending && handle_server_socket(s) == EXIT_FAILURE) {
+            goto FAIL;
+        }
+        if ((long)s->now > s->wheel_tick) {
+            sample_queues(s);
+        }
+        run_timers(s);
+        // Sockets are only closed here, so no descriptor is reused while
+        // events for it may still be in this batch. Departures queue more
+        // messages, so TLS clients are flushed after.
+        close_marked_clients(s);
+        flush_tls_clients(s);
+        stat_time(s->stats.loop_us, now_ns() - woke_ns);
     }
+    say_goodbye(s);
+    return NULL;
+
+FAIL:
+    atomic_store(&exit_status, EXIT_FAILURE);
+    kill(getpid(), SIGINT);
+    say_goodbye(s);
+    return NULL;
+}
+
+/**
+ * Sets up a shard: a listening socket of its own on the shared port, an
+ * epoll set, and the eventfd that other shards use to wake it.
+ * Returns false on failure, after printing an error.
+ */
+bool init_shard(shard *s, int id, int port) {
+    s->id = id;
+    s->listen_fd = s->epoll_fd = s->event_fd = -1;
+    atomic_init(&s->wakeup_pending, false);
+    s->now = now_seconds();
+    s->wheel_tick = (long)s->now;
+    inbox_init(&s->inbox);
 
     // Create a server socket.
-    if ((server_socket = socket(AF_INET , SOCK_STREAM , 0)) < 0) {
+    if ((s->listen_fd = socket(AF_INET , SOCK_STREAM , 0)) < 0) {
         fprintf(stderr, "Error: Failed to create socket. %s.\n",
                 strerror(errno));
-        return EXIT_FAILURE;
+        return false;
     }
 
-    int opt;
+    int opt = 1;
     // SO_REUSEADDR tells the kernel that even if this port is busy (in the
     // TIME_WAIT state), go ahead and reuse it anyway. If it is busy, but with
     // another state, you will still get an address already in use error. It is
     // useful if your server has been shut down, and then restarted right away
     // while sockets are still active on its port.
+    // SO_REUSEPORT lets every shard bind its own socket to the same port, and
+    // the kernel balances incoming connections across them.
     if (setsockopt(
-            server_socket, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(int)) != 0) {
+            s->listen_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(int)) != 0 ||
+            setsockopt(
+            s->listen_fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(int)) != 0) {
         fprintf(stderr, "Error: Failed to set socket options. %s.\n",
                 strerror(errno));
-        retval = EXIT_FAILURE;
-        goto EXIT;
+        return false;
     }
 
+    struct sockaddr_in server_addr;
+    socklen_t addrlen = sizeof(struct sockaddr_in);
     memset(&server_addr, 0, addrlen);         // Zero out structure
     server_addr.sin_family = AF_INET;         // Internet address family
     server_addr.sin_addr.s_addr = INADDR_ANY; // Internet address, 32 bits
     server_addr.sin_port = htons(port);       // Server port, 16 bits
 
     // Bind to the local address.
-    if (bind(server_socket, (struct sockaddr *)&server_addr, addrlen) < 0) {
+    if (bind(s->listen_fd, (struct sockaddr *)&server_addr, addrlen) < 0) {
         fprintf(stderr, "Error: Failed to bind socket to port %d. %s.\n", port,
                 strerror(errno));
-        retval = EXIT_FAILURE;
-        goto EXIT;
+        return false;
     }
 
     // Mark the socket so it will listen for incoming connections.
-    if (listen(server_socket, MAX_CONNECTIONS) < 0) {
+    if (listen(s->listen_fd, SOMAXCONN) < 0) {
         fprintf(stderr,
                 "Error: Failed to listen for incoming connections. %s.\n",
                 strerror(errno));
-        retval = EXIT_FAILURE;
-        goto EXIT;
-    }
-
-    printf("Chat server is up and running on port %d.\nPress CTRL+C to exit.\n",
-           port);
-    fd_set sockset;
-    int max_socket;
-    while (running) {
-        // Zero out and set socket descriptors for server sockets.
-        // This must be reset every time select() is called.
-        FD_ZERO(&sockset);
-        FD_SET(server_socket, &sockset);
-        max_socket = server_socket;
-
-        // Add client sockets to set.
-        for (int i = 0; i < MAX_CONNECTIONS; i++) {   
-            // If socket descriptor is valid, add it to the set.
-            if (client_sockets[i] > -1) {
-                FD_SET(client_sockets[i], &sockset);
+        return false;
+    }
+
+    // Sockets are registered once and stay in the epoll set until they are
+    // closed, instead of being rebuilt into an fd_set on every iteration.
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLET;
+    event.data.fd = s->listen_fd;
+    if ((s->epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0 ||
+            !set_nonblocking(s->listen_fd) ||
+            epoll_ctl(s->epoll_fd, EPOLL_CTL_ADD, s->listen_fd, &event) < 0) {
+        fprintf(stderr, "Error: Failed to set up epoll. %s.\n",
+                strerror(errno));
+        return false;
+    }
+    event.events = EPOLLIN | EPOLLET;
+    event.data.fd = s->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (s->event_fd < 0 ||
+            epoll_ctl(s->epoll_fd, EPOLL_CTL_ADD, s->event_fd, &event) < 0) {
+        fprintf(stderr, "Error: Failed to set up eventfd. %s.\n",
+                strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Adds up one of the shards' counters, given its offset in shard_stats.
+ */
+long stat_total(size_t offset) {
+    long total = 0;
+    for (int i = 0; i < num_shards; i++) {
+        total += atomic_load_explicit(
+                (atomic_long *)((char *)&shards[i].stats + offset),
+                memory_order_relaxed);
+    }
+    return total;
+}
+
+#define STAT_TOTAL(field) stat_total(offsetof(shard_stats, field))
+
+/**
+ * Appends to a report, which is left as it is once it is full.
+ */
+__attribute__((format(printf, 3, 4)))
+void report_printf(char *buf, size_t *len, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    int n = vsnprintf(buf + *len, MAX_METRICS_LEN - *len, format, args);
+    va_end(args);
+    if (n > 0 && (size_t)n < MAX_METRICS_LEN - *len) {
+        *len += n;
+    }
+}
+
+/**
+ * Appends a histogram of times, summed across the shards, with the
+ * cumulative buckets of the Prometheus text format.
+ */
+void report_histogram(char *buf, size_t *len, const char *name,
+                      size_t offset) {
+    long count = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        count += stat_total(offset + i * sizeof(atomic_long));
+        if (i < HIST_BUCKETS - 1) {
+            report_printf(buf, len, "%s_bucket{le=\"%lu\"} %ld\n", name,
+                          1UL << i, count);
+        }
+    }
+    report_printf(buf, len, "%s_bucket{le=\"+Inf\"} %ld\n%s_count %ld\n",
+                  name, count, name, count);
+}
+
+/**
+ * Formats the metrics report: totals since startup, rates since the last
+ * report, the sampled client backlogs, and the fan-out and event loop
+ * histograms in microseconds.
+ * Returns the length of the report.
+ */
+size_t format_metrics(char *buf) {
+    // Only the metrics thread formats reports, so it keeps the last one's
+    // totals to work out the rates.
+    static double last_time = 0;
+    static long last[4] = { 0 };
+    const char *names[4] = { "messages_in", "bytes_in", "messages_out",
+                             "bytes_out" };
+    long totals[4] = { STAT_TOTAL(msgs_in), STAT_TOTAL(bytes_in),
+                       STAT_TOTAL(msgs_out), STAT_TOTAL(bytes_out) };
+    double now = now_seconds();
+    double elapsed = now - (last_time > 0 ? last_time : started_at);
+    size_t len = 0;
+
+    report_printf(buf, &len, "chat_uptime_seconds %.0f\n"
+                  "chat_connections %ld\n", now - started_at,
+                  STAT_TOTAL(connections));
+    for (int i = 0; i < num_shards; i++) {
+        report_printf(buf, &len, "chat_shard_connections{shard=\"%d\"} %ld\n",
+                      i, atomic_load_explicit(&shards[i].stats.connections,
+                                              memory_order_relaxed));
+    }
+    for (int i = 0; i < 4; i++) {
+        report_printf(buf, &len, "chat_%s_total %ld\n"
+                      "chat_%s_per_second %.1f\n", names[i], totals[i],
+                      names[i], elapsed > 0 ? (totals[i] - last[i]) / elapsed
+                                            : 0);
+        last[i] = totals[i];
+    }
+    last_time = now;
+    report_printf(buf, &len, "chat_refused_total %ld\n"
+                  "chat_timed_out_total %ld\n"
+                  "chat_dropped_slow_total %ld\n"
+                  "chat_shed_messages_total %ld\n", STAT_TOTAL(refused),
+                  STAT_TOTAL(timed_out), STAT_TOTAL(dropped_slow),
+                  STAT_TOTAL(shed_messages));
+
+    long max_queued = 0;
+    for (int i = 0; i < num_shards; i++) {
+        long bytes = atomic_load_explicit(&shards[i].stats.max_queued_bytes,
+                                          memory_order_relaxed);
+        max_queued = bytes > max_queued ? bytes : max_queued;
+    }
+    report_printf(buf, &len, "chat_backlogged_clients %ld\n"
+                  "chat_queued_messages %ld\n"
+                  "chat_queued_bytes %ld\n"
+                  "chat_max_client_queued_bytes %ld\n",
+                  STAT_TOTAL(queued_clients), STAT_TOTAL(queued_msgs),
+                  STAT_TOTAL(queued_bytes), max_queued);
+
+    report_histogram(buf, &len, "chat_fanout_latency_us",
+                     offsetof(shard_stats, fanout_us));
+    report_histogram(buf, &len, "chat_loop_time_us",
+                     offsetof(shard_stats, loop_us));
+    return len;
+}
+
+/**
+ * Serves a report to each connection on the metrics socket, then closes it.
+ * A reader that does not take the report within a second is given up on.
+ * Returns once the socket is shut down.
+ */
+void *run_metrics(void *arg) {
+    static char report[MAX_METRICS_LEN];
+    struct timeval timeout = { 1, 0 };
+    while (true) {
+        int fd = accept(metrics_fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            break;
+        }
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        size_t len = format_metrics(report), done = 0;
+        while (done < len) {
+            ssize_t n = send(fd, report + done, len - done, MSG_NOSIGNAL);
+            if (n < 0 && errno == EINTR) {
+                continue;
             }
-            // Keep track of the highest file descriptor number.
-            // It is needed for the select() function.
-            if (client_sockets[i] > max_socket) {
-                max_socket = client_sockets[i];
+            if (n <= 0) {
+                break;
             }
+            done += n;
         }
+        close(fd);
+    }
+    return NULL;
+}
 
-        // Wait for activity on one of the sockets.
-        // Timeout is NULL, so wait indefinitely.
-        if (select(max_socket + 1, &sockset, NULL, NULL, NULL) < 0
-                && errno != EINTR) {
-            print_date_time_header(stderr);
-            fprintf(stderr, "Error: select() failed. %s.\n", strerror(errno));
-            retval = EXIT_FAILURE;
-            goto EXIT;
-        }
+/**
+ * Listens for metrics readers on a UNIX socket at path, which only the
+ * server's user may connect to. A socket left at path by an earlier run is
+ * replaced; any other file is not.
+ * Returns false on failure, after printing an error.
+ */
+bool open_metrics_socket(const char *path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Error: Metrics socket path '%s' is too long.\n",
+                path);
+        return false;
+    }
+    strcpy(addr.sun_path, path);
+    struct stat st;
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        unlink(path);
+    }
+    if ((metrics_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
+        fprintf(stderr, "Error: socket() failed. %s.\n", strerror(errno));
+        return false;
+    }
+    mode_t mask = umask(077);
+    int ret = bind(metrics_fd, (struct sockaddr *)&addr, sizeof(addr));
+    umask(mask);
+    if (ret < 0 || listen(metrics_fd, SOMAXCONN) < 0) {
+        fprintf(stderr, "Error: Cannot listen on metrics socket '%s'. %s.\n",
+                path, strerror(errno));
+        close(metrics_fd);
+        metrics_fd = -1;
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Main function.
+ * Starts the shards, waits for CTRL+C, and cleans up.
+ */
+int main(int argc, char *argv[]) {
+    int retval = EXIT_SUCCESS, num_started = 0, level = LOG_DEBUG, opt;
+    bool metrics_started = false;
+    const char *program = argv[0], *history_path = NULL;
+    const char *cert_path = NULL, *key_path = NULL;
 
-        // If there is activity on the server socket, handle the incoming
-        // connection.
-        if (running && FD_ISSET(server_socket, &sockset)) {
-            if (handle_server_socket() == EXIT_FAILURE) {
-                retval = EXIT_FAILURE;
-                goto EXIT;
+    // Parse command line arguments for log level, history file, TLS
+    // certificate and key, admission limits, metrics socket, port number and
+    // thread count.
+    // Per-message lines are logged at the debug level, so "-l info" turns
+    // them off.
+    opterr = 0;
+    while ((opt = getopt(argc, argv, "a:c:f:i:k:l:m:s:")) != -1) {
+        if (opt == 'a' || opt == 'i' || opt == 'm') {
+            int *limit = opt == 'a' ? &ip_rate
+                    : opt == 'i' ? &idle_timeout : &msg_rate;
+            const char *name = opt == 'a' ? "connections per second"
+                    : opt == 'i' ? "idle seconds" : "messages per second";
+            if (!parse_int(optarg, limit, name)) {
+                return EXIT_FAILURE;
             }
+            if (*limit < 0) {
+                fprintf(stderr, "Error: %s must be at least 0.\n", name);
+                return EXIT_FAILURE;
+            }
+        } else if (opt == 'c') {
+            cert_path = optarg;
+        } else if (opt == 'f') {
+            history_path = optarg;
+        } else if (opt == 'k') {
+            key_path = optarg;
+        } else if (opt == 's') {
+            metrics_path = optarg;
+        } else if (opt != 'l' || !parse_log_level(optarg, &level)) {
+            argc = 0;
+            break;
+        }
+    }
+    argc -= optind;
+    argv += optind;
+    if ((argc != 1 && argc != 2) ||
+            (cert_path == NULL) != (key_path == NULL)) {
+        fprintf(stderr, "Usage: %s [-l debug|info|warning|error] "
+                "[-f history file] [-c certificate file -k key file] "
+                "[-a connections per second per address] "
+                "[-m messages per second per client] [-i idle seconds] "
+                "[-s metrics socket] <port number> [threads]\n", program);
+        return EXIT_FAILURE;
+    }
+    int port;
+    if (!parse_int(argv[0], &port, "port number")) {
+        return EXIT_FAILURE;
+    }
+    if (port < 1024 || port > 65535) {
+        fprintf(stderr, "Error: port must be in range [1024, 65535].\n");
+        return EXIT_FAILURE;
+    }
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    num_shards = cpus < 1 ? 1 : cpus > MAX_SHARDS ? MAX_SHARDS : (int)cpus;
+    if (argc == 2) {
+        if (!parse_int(argv[1], &num_shards, "threads")) {
+            return EXIT_FAILURE;
+        }
+        if (num_shards < 1 || num_shards > MAX_SHARDS) {
+            fprintf(stderr, "Error: threads must be in range [1, %d].\n",
+                    MAX_SHARDS);
+            return EXIT_FAILURE;
         }
+    }
+
+    if (cert_path != NULL &&
+            (tls_ctx = tls_server_ctx(cert_path, key_path)) == NULL) {
+        fprintf(stderr, "Error: Failed to load certificate and key. %s.\n",
+                tls_strerror());
+        return EXIT_FAILURE;
+    }
+
+    // SIGINT, CTRL+C, is blocked in every thread and taken by sigwait()
+    // below, so no worker is interrupted by it. Threads inherit the mask.
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    if (pthread_sigmask(SIG_BLOCK, &signals, NULL) != 0) {
+        fprintf(stderr, "Error: Failed to block signals. %s.\n",
+                strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    // The flush thread starts after SIGINT is blocked, so it inherits that.
+    if (!log_start(level)) {
+        fprintf(stderr, "Error: Failed to start logging. %s.\n",
+                strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    // Allow as many descriptors as the hard limit permits, since each client
+    // needs one.
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    if (history_path != NULL && !open_history_file(history_path)) {
+        close_histories();
+        log_stop();
+        return EXIT_FAILURE;
+    }
+    if (metrics_path != NULL && !open_metrics_socket(metrics_path)) {
+        close_histories();
+        log_stop();
+        return EXIT_FAILURE;
+    }
+    started_at = now_seconds();
 
-        // Find and handle the client sockets sending messages.
-        for (int i = 0; running && i < MAX_CONNECTIONS; i++) {
-            // Important to check for open socket before FD_ISSET.
-            if (client_sockets[i] > -1 && 
-                FD_ISSET(client_sockets[i], &sockset)) {  
-                handle_client_socket(i);
-            }   
+    // Every shard is set up before any thread starts, so a publishing shard
+    // never sees another's inbox half-built.
+    for (int i = 0; i < num_shards; i++) {
+        if (!init_shard(&shards[i], i, port)) {
+            num_shards = i + 1;
+            retval = EXIT_FAILURE;
+            goto EXIT;
+        }
+    }
+    for (; num_started < num_shards; num_started++) {
+        int err = pthread_create(&shards[num_started].thread, NULL, run_shard,
+                                 &shards[num_started]);
+        if (err != 0) {
+            fprintf(stderr, "Error: Failed to create thread. %s.\n",
+                    strerror(err));
+            retval = EXIT_FAILURE;
+            goto EXIT;
+        }
+    }
+    if (metrics_fd >= 0) {
+        int err = pthread_create(&metrics_thread, NULL, run_metrics, NULL);
+        if (err != 0) {
+            fprintf(stderr, "Error: Failed to create thread. %s.\n",
+                    strerror(err));
+            retval = EXIT_FAILURE;
+            goto EXIT;
         }
+        metrics_started = true;
     }
 
+    printf("Chat server is up and running on port %d with %d thread%s%s.\n"
+           "Press CTRL+C to exit.\n", port, num_shards,
+           num_shards == 1 ? "" : "s", tls_ctx != NULL ? ", using TLS" : "");
+    fflush(stdout);
+    int sig;
+    sigwait(&signals, &sig);
+    retval = atomic_load(&exit_status);
+
 EXIT:
+    // Shutting the metrics socket down wakes the thread blocked in accept().
+    if (metrics_fd >= 0) {
+        shutdown(metrics_fd, SHUT_RDWR);
+        if (metrics_started) {
+            pthread_join(metrics_thread, NULL);
+        }
+        close(metrics_fd);
+        unlink(metrics_path);
+    }
+    atomic_store(&running, false);
+    for (int i = 0; i < num_started; i++) {
+        wake_shard(&shards[i]);
+    }
+    long refused = 0, timed_out = 0, dropped_slow = 0, shed_messages = 0;
+    for (int i = 0; i < num_started; i++) {
+        pthread_join(shards[i].thread, NULL);
+        refused += atomic_load(&shards[i].stats.refused);
+        timed_out += atomic_load(&shards[i].stats.timed_out);
+        dropped_slow += atomic_load(&shards[i].stats.dropped_slow);
+        shed_messages += atomic_load(&shards[i].stats.shed_messages);
+    }
+    log_msg(LOG_INFO, "Shed %ld connections at accept, %ld timed out and %ld "
+            "slow clients, and %ld messages.\n", refused, timed_out,
+            dropped_slow, shed_messages);
     cleanup();
+    log_stop();
     printf("\n");
-    print_date_time_header(stdout);
-    printf("Shutting down.\n");
+    fflush(stdout);
+    log_msg(LOG_INFO, "Shutting down.\n");
     return retval;
 }
@@ -0,0 +1,276 @@
+#ifndef LOG_H_
+#define LOG_H_
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Asynchronous logging. Each thread formats its lines into a ring buffer of
+ * its own, which only that thread writes and only the flush thread reads,
+ * so logging takes no lock and makes no system call on the hot path. The
+ * flush thread collects every ring into one writev() every LOG_FLUSH_MS.
+ * If a ring is full, lines are dropped and counted rather than waited for.
+ *
+ * Warnings and errors are rare, so they skip the rings and go straight to
+ * stderr, in one write() per line.
+ */
+#define LOG_RING_SIZE   (1 << 20)   // bytes per thread, a power of two
+#define MAX_LOG_LINE    2048
+#define MAX_LOG_RINGS   128
+#define LOG_FLUSH_MS    10
+
+enum log_level_t { LOG_DEBUG, LOG_INFO, LOG_WARNING, LOG_ERROR };
+
+typedef struct log_ring {
+    atomic_size_t head;     // bytes ever written, advanced by the owner
+    atomic_size_t tail;     // bytes ever flushed, advanced by the flusher
+    atomic_size_t dropped;
+    char data[LOG_RING_SIZE];
+} log_ring;
+
+int log_level = LOG_DEBUG;
+_Atomic(log_ring *) log_rings[MAX_LOG_RINGS];
+atomic_int num_log_rings = 0;
+pthread_t log_thread;
+atomic_bool log_running = false;
+
+_Thread_local log_ring *thread_log_ring = NULL;
+_Thread_local bool thread_log_registered = false;
+// Formatting the date is the expensive part of a line, so each thread keeps
+// the header for the current second.
+_Thread_local time_t log_stamp_time = -1;
+_Thread_local char log_stamp[64];
+_Thread_local size_t log_stamp_len = 0;
+
+/**
+ * Parses a level name: debug, info, warning, or error.
+ * Returns false if the name is not one of them.
+ */
+bool parse_log_level(const char *name, int *level) {
+    static const char *names[] = { "debug", "info", "warning", "error" };
+    for (int i = LOG_DEBUG; i <= LOG_ERROR; i++) {
+        if (strcmp(name, names[i]) == 0) {
+            *level = i;
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Writes all of buf to fd, for lines that do not go through a ring.
+ */
+void log_write(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return;
+        }
+        buf += n;
+        len -= n;
+    }
+}
+
+/**
+ * Returns the calling thread's ring, registering a new one on first use,
+ * or NULL if there is no room for another.
+ */
+log_ring *log_get_ring() {
+    if (thread_log_registered) {
+        return thread_log_ring;
+    }
+    thread_log_registered = true;
+    int i = atomic_fetch_add(&num_log_rings, 1);
+    if (i >= MAX_LOG_RINGS) {
+        return NULL;
+    }
+    log_ring *ring = malloc(sizeof(log_ring));
+    if (ring != NULL) {
+        atomic_init(&ring->head, 0);
+        atomic_init(&ring->tail, 0);
+        atomic_init(&ring->dropped, 0);
+    }
+    atomic_store_explicit(&log_rings[i], ring, memory_order_release);
+    return thread_log_ring = ring;
+}
+
+/**
+ * Logs a line at the given level, with a date/time header. The line is
+ * formatted with printf conventions and should end in a new line.
+ */
+__attribute__((format(printf, 2, 3)))
+void log_msg(int level, const char *format, ...) {
+    if (level < log_level) {
+        return;
+    }
+    char line[MAX_LOG_LINE];
+    time_t t = time(NULL);
+    if (t != log_stamp_time) {
+        struct tm tm;
+        localtime_r(&t, &tm);
+        log_stamp_len = strftime(log_stamp, sizeof(log_stamp), "%c: ", &tm);
+        log_stamp_time = t;
+    }
+    memcpy(line, log_stamp, log_stamp_len);
+    va_list args;
+    va_start(args, format);
+    int n = vsnprintf(line + log_stamp_len, sizeof(line) - log_stamp_len,
+                      format, args);
+    va_end(args);
+    size_t len = log_stamp_len + (n < 0 ? 0 : (size_t)n);
+    if (len >= sizeof(line)) {
+        // Truncated, but still one whole line.
+        len = sizeof(line) - 1;
+        line[len - 1] = '\n';
+    }
+
+    log_ring *ring;
+    if (level >= LOG_WARNING || !atomic_load(&log_running) ||
+            (ring = log_get_ring()) == NULL) {
+        log_write(level >= LOG_WARNING ? STDERR_FILENO : STDOUT_FILENO, line,
+                  len);
+        return;
+    }
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    if (LOG_RING_SIZE - (head - tail) < len) {
+        atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+        return;
+    }
+    size_t start = head & (LOG_RING_SIZE - 1);
+    size_t first = len < LOG_RING_SIZE - start ? len : LOG_RING_SIZE - start;
+    memcpy(ring->data + start, line, first);
+    memcpy(ring->data, line + first, len - first);
+    atomic_store_explicit(&ring->head, head + len, memory_order_release);
+}
+
+/**
+ * Writes out everything the rings hold in one writev() per batch of rings.
+ */
+void log_flush() {
+    struct iovec iov[2 * MAX_LOG_RINGS + 1];
+    log_ring *rings[MAX_LOG_RINGS];
+    size_t heads[MAX_LOG_RINGS];
+    char notice[64];
+    int n = 0, count = atomic_load(&num_log_rings);
+    size_t dropped = 0;
+    count = count < MAX_LOG_RINGS ? count : MAX_LOG_RINGS;
+    for (int i = 0; i < count; i++) {
+        // A ring being registered right now is picked up next time.
+        log_ring *ring = rings[i] = atomic_load_explicit(&log_rings[i],
+                                                         memory_order_acquire);
+        if (ring == NULL) {
+            continue;
+        }
+        dropped += atomic_exchange_explicit(&ring->dropped, 0,
+                                            memory_order_relaxed);
+        size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        heads[i] = head;
+        size_t start = tail & (LOG_RING_SIZE - 1), len = head - tail;
+        size_t first = len < LOG_RING_SIZE - start ? len
+                                                    : LOG_RING_SIZE - start;
+        if (first > 0) {
+            iov[n].iov_base = ring->data + start;
+            iov[n++].iov_len = first;
+        }
+        if (len > first) {
+            iov[n].iov_base = ring->data;
+            iov[n++].iov_len = len - first;
+        }
+    }
+    if (dropped > 0) {
+        iov[n].iov_base = notice;
+        iov[n++].iov_len = sprintf(notice, "[%zu log lines dropped]\n",
+                                   dropped);
+    }
+
+    struct iovec *next = iov;
+    while (n > 0) {
+        ssize_t written = writev(STDOUT_FILENO, next, n);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        // Skip what was written, which may end in the middle of an iovec.
+        while (n > 0 && (size_t)written >= next->iov_len) {
+            written -= next->iov_len;
+            next++;
+            n--;
+        }
+        if (n > 0) {
+            next->iov_base = (char *)next->iov_base + written;
+            next->iov_len -= written;
+        }
+    }
+    // The space is released even if stdout failed, so logging never stalls.
+    for (int i = 0; i < count; i++) {
+        if (rings[i] != NULL) {
+            atomic_store_explicit(&rings[i]->tail, heads[i],
+                                  memory_order_release);
+        }
+    }
+}
+
+void *run_log_flusher(void *arg) {
+    struct timespec interval = { 0, LOG_FLUSH_MS * 1000000L };
+    while (atomic_load(&log_running)) {
+        log_flush();
+        nanosleep(&interval, NULL);
+    }
+    return NULL;
+}
+
+/**
+ * Starts the flush thread. Until it runs, and after log_stop(), lines are
+ * written synchronously.
+ * Returns false if the thread could not be created.
+ */
+bool log_start(int level) {
+    log_level = level;
+    fflush(stdout);
+    atomic_store(&log_running, true);
+    int err = pthread_create(&log_thread, NULL, run_log_flusher, NULL);
+    if (err != 0) {
+        atomic_store(&log_running, false);
+        errno = err;
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Stops the flush thread once every thread that logs has stopped, and
+ * writes out and frees the rings.
+ */
+void log_stop() {
+    if (!atomic_exchange(&log_running, false)) {
+        return;
+    }
+    pthread_join(log_thread, NULL);
+    log_flush();
+    int count = atomic_load(&num_log_rings);
+    for (int i = 0; i < count && i < MAX_LOG_RINGS; i++) {
+        free(atomic_load(&log_rings[i]));
+        atomic_store(&log_rings[i], NULL);
+    }
+    atomic_store(&num_log_rings, 0);
+    thread_log_ring = NULL;
+    thread_log_registered = false;
+}
+
+#endif
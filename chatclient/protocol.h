@@ -0,0 +1,96 @@
+#ifndef PROTOCOL_H_
+#define PROTOCOL_H_
+
+#include <arpa/inet.h>
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * Every message between client and server is a frame: a 4-byte payload
+ * length in network byte order, a 1-byte type, then the payload. TCP may
+ * split or merge frames arbitrarily, so receivers collect bytes in a buffer
+ * and only act on complete frames.
+ *
+ *   FRAME_JOIN     client -> server: the user name, sent once.
+ *                  server -> client: the name of a user who joined.
+ *   FRAME_LEAVE    server -> client: the name of a user who left.
+ *   FRAME_CHAT     client -> server: the message text.
+ *                  server -> client: sender name, '\0', message text.
+ *   FRAME_BYE      either way, empty: the sender is closing.
+ *   FRAME_WELCOME  server -> client: the welcome text and user list.
+ *   FRAME_ROOM     client -> server: the room to move to, or empty to go
+ *                  back to the room everyone starts in.
+ *                  server -> client: the new room's name and user list.
+ *
+ * Join, leave and chat frames from the server concern the client's room.
+ */
+#define FRAME_HEADER_LEN 5
+// Largest frame a client accepts. The welcome message lists every user.
+#define MAX_FRAME_LEN    (4 * 1024 * 1024)
+#define MAX_ROOM_LEN     20
+
+enum frame_type_t {
+    FRAME_JOIN = 1,
+    FRAME_LEAVE,
+    FRAME_CHAT,
+    FRAME_BYE,
+    FRAME_WELCOME,
+    FRAME_ROOM
+};
+
+enum frame_status_t { FRAME_INCOMPLETE, FRAME_READY, FRAME_INVALID };
+
+typedef struct frame {
+    int type;
+    const char *payload;    // not NUL terminated
+    size_t len;
+} frame;
+
+/**
+ * Writes a frame header for a payload of len bytes into buf.
+ * Returns FRAME_HEADER_LEN.
+ */
+size_t frame_header(char *buf, int type, size_t len) {
+    uint32_t net_len = htonl((uint32_t)len);
+    memcpy(buf, &net_len, 4);
+    buf[4] = (char)type;
+    return FRAME_HEADER_LEN;
+}
+
+/**
+ * Writes a complete frame into buf, which must have room for
+ * FRAME_HEADER_LEN + len bytes.
+ * Returns the size of the frame.
+ */
+size_t frame_encode(char *buf, int type, const char *payload, size_t len) {
+    frame_header(buf, type, len);
+    memcpy(buf + FRAME_HEADER_LEN, payload, len);
+    return FRAME_HEADER_LEN + len;
+}
+
+/**
+ * Looks for a complete frame at the start of the avail bytes in buf.
+ * Returns FRAME_READY and fills in f if there is one, FRAME_INCOMPLETE if
+ * more bytes are needed, or FRAME_INVALID if the frame is longer than
+ * max_payload or has an unknown type.
+ */
+int frame_parse(const char *buf, size_t avail, size_t max_payload, frame *f) {
+    if (avail < FRAME_HEADER_LEN) {
+        return FRAME_INCOMPLETE;
+    }
+    uint32_t net_len;
+    memcpy(&net_len, buf, 4);
+    f->len = ntohl(net_len);
+    f->type = (unsigned char)buf[4];
+    if (f->len > max_payload || f->type < FRAME_JOIN ||
+            f->type > FRAME_ROOM) {
+        return FRAME_INVALID;
+    }
+    if (avail < FRAME_HEADER_LEN + f->len) {
+        return FRAME_INCOMPLETE;
+    }
+    f->payload = buf + FRAME_HEADER_LEN;
+    return FRAME_READY;
+}
+
+#endif
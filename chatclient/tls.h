@@ -0,0 +1,179 @@
+#ifndef TLS_H_
+#define TLS_H_
+
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#include <openssl/x509v3.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sys/types.h>
+
+/*
+ * Optional TLS for the chat programs. Sockets stay non-blocking and in the
+ * caller's event loop: tls_recv() and tls_send() behave like recv() and
+ * send(), failing with EAGAIN whenever OpenSSL needs the socket to become
+ * readable or writable, and returning 0 once the peer has closed.
+ *
+ * A TLS record is at most TLS_RECORD_LEN bytes of data, and each one costs a
+ * header, a tag and a pass of the cipher, so writers that batch frames into
+ * full records pay that once per batch rather than once per message.
+ */
+#define TLS_RECORD_LEN  16384
+
+/**
+ * Returns a description of the last TLS failure on this thread, or of errno
+ * if OpenSSL recorded none, and clears the thread's error queue.
+ */
+const char *tls_strerror() {
+    static _Thread_local char buf[256];
+    unsigned long err = ERR_peek_last_error();
+    if (err == 0) {
+        return strerror(errno == 0 ? ECONNRESET : errno);
+    }
+    ERR_error_string_n(err, buf, sizeof(buf));
+    ERR_clear_error();
+    return buf;
+}
+
+/**
+ * Settings shared by both ends. Writes may be partial and retried from a
+ * buffer that has moved, like send() on a non-blocking socket, and buffers
+ * are released while a connection is idle, since a server holds thousands.
+ * A peer that closes without a close_notify is an ordinary end of file: the
+ * chat protocol says goodbye in its own frames. OpenSSL writes with write(),
+ * not send() with MSG_NOSIGNAL, so a peer that has gone away would raise
+ * SIGPIPE; it is ignored, and the write fails with EPIPE instead.
+ */
+void tls_set_modes(SSL_CTX *ctx) {
+    signal(SIGPIPE, SIG_IGN);
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+    SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE |
+                     SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER |
+                     SSL_MODE_RELEASE_BUFFERS);
+    SSL_CTX_set_options(ctx, SSL_OP_IGNORE_UNEXPECTED_EOF);
+}
+
+/**
+ * Creates the server's context from a PEM certificate chain and key.
+ * Returns NULL on failure.
+ */
+SSL_CTX *tls_server_ctx(const char *cert_file, const char *key_file) {
+    SSL_CTX *ctx = SSL_CTX_new(TLS_server_method());
+    if (ctx == NULL ||
+            SSL_CTX_use_certificate_chain_file(ctx, cert_file) != 1 ||
+            SSL_CTX_use_PrivateKey_file(ctx, key_file, SSL_FILETYPE_PEM) != 1 ||
+            SSL_CTX_check_private_key(ctx) != 1) {
+        SSL_CTX_free(ctx);
+        return NULL;
+    }
+    tls_set_modes(ctx);
+    // Sessions resume from stateless tickets, sealed with a key held by the
+    // context, so every thread sharing it can resume any client's session
+    // without a locked server-side cache. One ticket covers one reconnect.
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_OFF);
+    SSL_CTX_set_num_tickets(ctx, 1);
+    return ctx;
+}
+
+/**
+ * Creates a client context that trusts the PEM certificates in ca_file, or
+ * the system's if it is NULL. A self-signed server certificate is its own
+ * CA. new_session, if not NULL, is called with each ticket the server sends.
+ * Returns NULL on failure.
+ */
+SSL_CTX *tls_client_ctx(const char *ca_file,
+                        int (*new_session)(SSL *, SSL_SESSION *)) {
+    SSL_CTX *ctx = SSL_CTX_new(TLS_client_method());
+    if (ctx == NULL ||
+            (ca_file == NULL ? SSL_CTX_set_default_verify_paths(ctx)
+                    : SSL_CTX_load_verify_locations(ctx, ca_file, NULL)) != 1) {
+        SSL_CTX_free(ctx);
+        return NULL;
+    }
+    tls_set_modes(ctx);
+    SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, NULL);
+    if (new_session != NULL) {
+        SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT |
+                                       SSL_SESS_CACHE_NO_INTERNAL_STORE);
+        SSL_CTX_sess_set_new_cb(ctx, new_session);
+    }
+    return ctx;
+}
+
+/**
+ * Starts TLS on a connected socket. A client passes the server's address,
+ * which its certificate must name; the server passes NULL.
+ * Returns NULL on failure.
+ */
+SSL *tls_new(SSL_CTX *ctx, int fd, const char *server_ip) {
+    SSL *ssl = SSL_new(ctx);
+    if (ssl == NULL || SSL_set_fd(ssl, fd) != 1 ||
+            (server_ip != NULL &&
+             X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(ssl),
+                                           server_ip) != 1)) {
+        SSL_free(ssl);
+        return NULL;
+    }
+    if (server_ip == NULL) {
+        SSL_set_accept_state(ssl);
+    } else {
+        SSL_set_connect_state(ssl);
+    }
+    return ssl;
+}
+
+/**
+ * Moves the handshake on as far as the socket allows.
+ * Returns 1 once it is done, 0 if it is waiting for the socket, or -1 if it
+ * failed.
+ */
+int tls_handshake(SSL *ssl) {
+    ERR_clear_error();
+    errno = 0;
+    int ret = SSL_do_handshake(ssl);
+    if (ret == 1) {
+        return 1;
+    }
+    int err = SSL_get_error(ssl, ret);
+    return err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE ? 0 : -1;
+}
+
+/**
+ * Turns the result of SSL_read() or SSL_write() into that of recv() or
+ * send().
+ */
+ssize_t tls_result(SSL *ssl, int ret) {
+    if (ret > 0) {
+        return ret;
+    }
+    switch (SSL_get_error(ssl, ret)) {
+        case SSL_ERROR_WANT_READ:
+        case SSL_ERROR_WANT_WRITE:
+            errno = EAGAIN;
+            return -1;
+        case SSL_ERROR_ZERO_RETURN:
+            return 0;
+        case SSL_ERROR_SYSCALL:
+            return errno == 0 ? 0 : -1;
+        default:
+            errno = EPROTO;
+            return -1;
+    }
+}
+
+ssize_t tls_recv(SSL *ssl, void *buf, size_t len) {
+    ERR_clear_error();
+    errno = 0;
+    return tls_result(ssl, SSL_read(ssl, buf, len > INT_MAX ? INT_MAX : len));
+}
+
+ssize_t tls_send(SSL *ssl, const void *buf, size_t len) {
+    ERR_clear_error();
+    errno = 0;
+    return tls_result(ssl, SSL_write(ssl, buf, len > INT_MAX ? INT_MAX : len));
+}
+
+#endif
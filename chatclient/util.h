@@ -13,11 +13,13 @@
 #define BUFLEN       MAX_MSG_LEN + MAX_NAME_LEN + 4
                      // +3 = '[' before name, "]: " after name
 
-enum parse_string_t { OK, NO_INPUT, TOO_LONG };
+// Input is read in blocks of this size, which must hold a whole message.
+#define LINE_BUFLEN  65536
+
+enum parse_string_t { OK, NO_INPUT, TOO_LONG, NO_LINE };
 
 /* Functions that should be used in client and server. */
 bool parse_int(const char *input, int *i, const char *usage);
-int get_string(char *buf, const size_t sz);
 
 /**
  * Determines if the string input represent a valid integer.
@@ -66,38 +68,81 @@ bool parse_int(const char *input, int *i, const char *usage) {
 }
 
 /**
- * Reads a string fron STDIN up to sz characters. If more than sz characters
- * are supplied, the function consumes them.
- * Returns OK, NO_INPUT, or TOO_LONG.
+ * Lines read from a file descriptor in large blocks, rather than with a
+ * read() per character, and handed out one at a time.
  */
-int get_string(char *buf, const size_t sz) {
-    ssize_t bytes_read = read(STDIN_FILENO, buf, sz);
-    if (bytes_read < 0) {
-        fprintf(stderr,
-                "Warning: Failed to read message from keyboard. %s.\n",
-                strerror(errno));
-        return NO_INPUT;
-    } else if (bytes_read == 0) {
-        return NO_INPUT;
-    }
+typedef struct line_reader {
+    int fd;
+    char buf[LINE_BUFLEN];
+    size_t start, len;
+    bool discarding;        // skipping the rest of a line that was too long
+    bool eof;
+} line_reader;
 
-    // If it is too long, there'll be no new line character.
-    // Consume all remaining characters on the line.
-    char ch = 0;
-    bool extra = false;
-    if (buf[bytes_read - 1] != '\n') {
-        extra = true;
-        while (read(STDIN_FILENO, &ch, 1) > 0 && ch != '\n');
+void init_line_reader(line_reader *r, int fd) {
+    r->fd = fd;
+    r->start = r->len = 0;
+    r->discarding = false;
+    r->eof = false;
+}
+
+/**
+ * Reads once from the reader's descriptor, which blocks only if no input
+ * is ready.
+ * Returns the number of bytes read, 0 at end of file, or -1 on error.
+ */
+ssize_t fill_lines(line_reader *r) {
+    if (r->start > 0) {
+        memmove(r->buf, r->buf + r->start, r->len);
+        r->start = 0;
     }
-    if (extra) {
-        return TOO_LONG;
+    ssize_t n;
+    do {
+        n = read(r->fd, r->buf + r->len, sizeof(r->buf) - r->len);
+    } while (n < 0 && errno == EINTR);
+    if (n == 0) {
+        r->eof = true;
+    } else if (n > 0) {
+        r->len += n;
     }
-    // Replace new line character with '\0'.
-    buf[bytes_read - 1] = '\0';
-    if (strlen(buf) == 0) {
-        return NO_INPUT;
+    return n;
+}
+
+/**
+ * Takes the next buffered line, without its new line character, and copies
+ * up to sz characters of it into buf. A line longer than that is skipped,
+ * even if the rest of it has not been read yet. At end of file, a last line
+ * without a new line character still counts.
+ * Returns OK, NO_INPUT for an empty line, TOO_LONG, or NO_LINE if no whole
+ * line is buffered.
+ */
+int next_line(line_reader *r, char *buf, const size_t sz) {
+    while (true) {
+        char *start = r->buf + r->start;
+        char *nl = memchr(start, '\n', r->len);
+        size_t line_len = nl == NULL ? r->len : (size_t)(nl - start);
+        if (r->discarding) {
+            r->start += nl == NULL ? line_len : line_len + 1;
+            r->len -= nl == NULL ? line_len : line_len + 1;
+            if (nl == NULL) {
+                return NO_LINE;
+            }
+            r->discarding = false;
+            continue;
+        }
+        if (line_len > sz) {
+            r->discarding = true;
+            return TOO_LONG;
+        }
+        if (nl == NULL && !(r->eof && r->len > 0)) {
+            return NO_LINE;
+        }
+        memcpy(buf, start, line_len);
+        buf[line_len] = '\0';
+        r->start += nl == NULL ? line_len : line_len + 1;
+        r->len -= nl == NULL ? line_len : line_len + 1;
+        return line_len == 0 ? NO_INPUT : OK;
     }
-    return OK;
 }
 
 #endif
@@ -0,0 +1,106 @@
+#!/bin/bash
+###############################################################################
+# Author: Marjan Chowdhury
+# Description: Provides the basic functionality of a recycle bin
+###############################################################################
+
+readonly JUNK=~/.junk
+# Built by make; moves every file in one process, however many there are.
+readonly JUNKMV="$(dirname "$0")/junkmv"
+
+display_flag=0
+list_flag=0
+purge_flag=0
+stdin_flag=0
+file_flag=0
+
+name=$(basename "$0")
+
+display_usage() {
+cat << Here
+Usage: $name [-hlp0] [list of files]
+    -h: Display help.
+    -l: List junked files.
+    -p: Purge all files.
+    -0: Junk the NUL-separated files read from stdin, as from find -print0.
+    [list of files] with no other arguments to junk those files.
+Here
+}
+
+
+while getopts ":hlp0" option; do
+    case "$option" in
+        h) display_flag=1
+            ;;
+        l) list_flag=1
+            ;;
+        p) purge_flag=1
+            ;;
+        0) stdin_flag=1
+            ;;
+        ?) printf "Error: Unknown option '-%s'.\n" "$OPTARG" >&2
+            display_usage
+            exit 1
+            ;;
+    esac
+done
+
+
+if [ $# -eq 0 ]; then
+    display_usage
+    exit 0
+fi
+
+if [ ! -d "$JUNK" ]; then
+    mkdir "$JUNK"
+fi
+
+
+# Each argument is one file, whatever characters its name holds.
+shift "$((OPTIND-1))"
+file_array=("$@")
+if [ ${#file_array[@]} -gt 0 ]; then
+    file_flag=1
+fi
+
+
+if [ $(($display_flag + $list_flag + $purge_flag + $stdin_flag + \
+        $file_flag)) -gt 1 ]; then
+    printf "Error: Too many options enabled.\n" >&2
+            display_usage
+            exit 1
+fi
+
+
+if [ $display_flag -eq 1 ]; then
+    display_usage
+    exit 0
+
+elif [ $list_flag -eq 1 ]; then
+    ls -lAF "$JUNK"
+    exit 0
+
+elif [ $purge_flag -eq 1 ]; then
+    rm -r "$JUNK"
+    exit 0
+
+elif [ $stdin_flag -eq 1 ]; then
+    if [ -x "$JUNKMV" ]; then
+        "$JUNKMV" -0 "$JUNK"
+    else
+        xargs -0 -r mv -t "$JUNK" --
+    fi
+    exit $?
+
+elif [ $file_flag -eq 1 ]; then
+    # The names go through a pipe rather than the argument list, so there is
+    # no limit on how many there are. printf is a builtin, so it has none.
+    if [ -x "$JUNKMV" ]; then
+        printf '%s\0' "${file_array[@]}" | "$JUNKMV" -0 "$JUNK"
+    else
+        mv -- "${file_array[@]}" "$JUNK"
+    fi
+    exit $?
+fi
+
+exit 0
@@ -0,0 +1,310 @@
+/*******************************************************************************
+ * Name        : junkmv.c
+ * Author      : Marjan Chowdhury
+ * Description : Moves files into the junk directory for junk.sh
+ ******************************************************************************/
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define COPY_CHUNK (1024 * 1024)
+#define BUF_SIZE   65536
+
+// The junk directory, opened once so each file costs a single rename.
+int junk_fd = -1;
+
+/**
+ * Makes room for a new entry called name in dir_fd, replacing an old one
+ * the way rename() would: a file replaces a file, and a directory replaces
+ * an empty directory.
+ * Returns false with errno set if the old entry cannot be replaced.
+ */
+bool clear_target(int dir_fd, const char *name, bool is_dir) {
+    struct stat old;
+    if (fstatat(dir_fd, name, &old, AT_SYMLINK_NOFOLLOW) < 0) {
+        return errno == ENOENT;
+    }
+    if (S_ISDIR(old.st_mode) != is_dir) {
+        errno = is_dir ? ENOTDIR : EISDIR;
+        return false;
+    }
+    return unlinkat(dir_fd, name, is_dir ? AT_REMOVEDIR : 0) == 0;
+}
+
+/**
+ * Removes name in dir_fd, and everything under it if it is a directory.
+ * Returns false with errno set on failure.
+ */
+bool remove_tree(int dir_fd, const char *name) {
+    struct stat st;
+    if (fstatat(dir_fd, name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+        return false;
+    }
+    if (!S_ISDIR(st.st_mode)) {
+        return unlinkat(dir_fd, name, 0) == 0;
+    }
+    int fd = openat(dir_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+    DIR *dir = fd < 0 ? NULL : fdopendir(fd);
+    if (dir == NULL) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return false;
+    }
+    bool ok = true;
+    struct dirent *entry;
+    while (ok && (entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") != 0 &&
+                strcmp(entry->d_name, "..") != 0) {
+            ok = remove_tree(fd, entry->d_name);
+        }
+    }
+    int saved = errno;
+    closedir(dir);
+    errno = saved;
+    return ok && unlinkat(dir_fd, name, AT_REMOVEDIR) == 0;
+}
+
+/**
+ * Copies the data of one regular file, in the kernel where the filesystems
+ * allow it and through a buffer where they do not.
+ * Returns false with errno set on failure.
+ */
+bool copy_data(int in, int out) {
+    ssize_t n;
+    while ((n = copy_file_range(in, NULL, out, NULL, COPY_CHUNK, 0)) > 0) {
+    }
+    if (n == 0) {
+        return true;
+    }
+    if (errno != EXDEV && errno != ENOSYS && errno != EINVAL &&
+            errno != EOPNOTSUPP) {
+        return false;
+    }
+    char buf[BUF_SIZE];
+    while ((n = read(in, buf, sizeof(buf))) != 0) {
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        for (ssize_t done = 0; done < n; ) {
+            ssize_t written = write(out, buf + done, n - done);
+            if (written < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return false;
+            }
+            done += written;
+        }
+    }
+    return true;
+}
+
+/**
+ * Gives a copy the owner, permissions and times of the original, as far as
+ * the user is allowed to.
+ */
+void copy_attributes(int fd, const struct stat *st) {
+    struct timespec times[2] = { st->st_atim, st->st_mtim };
+    if (fchown(fd, st->st_uid, st->st_gid) < 0) {
+        // Only root may give files away; keep the user's own.
+    }
+    fchmod(fd, st->st_mode & 07777);
+    futimens(fd, times);
+}
+
+/**
+ * Copies src in src_fd to dst in dst_fd, which must not exist yet,
+ * recursively for a directory. Symbolic links are copied as links, and
+ * special files are recreated.
+ * Returns false with errno set on failure, possibly leaving part of the copy
+ * behind.
+ */
+bool copy_tree(int src_fd, const char *src, int dst_fd, const char *dst) {
+    struct stat st;
+    if (fstatat(src_fd, src, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+        return false;
+    }
+
+    if (S_ISLNK(st.st_mode)) {
+        char *target = malloc(st.st_size + 1);
+        ssize_t len;
+        if (target == NULL ||
+                (len = readlinkat(src_fd, src, target, st.st_size)) < 0) {
+            free(target);
+            return false;
+        }
+        target[len] = '\0';
+        bool ok = symlinkat(target, dst_fd, dst) == 0;
+        free(target);
+        if (ok) {
+            struct timespec times[2] = { st.st_atim, st.st_mtim };
+            utimensat(dst_fd, dst, times, AT_SYMLINK_NOFOLLOW);
+        }
+        return ok;
+    }
+    if (!S_ISREG(st.st_mode) && !S_ISDIR(st.st_mode)) {
+        if (mknodat(dst_fd, dst, st.st_mode, st.st_rdev) < 0) {
+            return false;
+        }
+        struct timespec times[2] = { st.st_atim, st.st_mtim };
+        utimensat(dst_fd, dst, times, AT_SYMLINK_NOFOLLOW);
+        return true;
+    }
+
+    int in = openat(src_fd, src, O_RDONLY | O_NOFOLLOW |
+                    (S_ISDIR(st.st_mode) ? O_DIRECTORY : 0));
+    if (in < 0) {
+        return false;
+    }
+    int out = -1;
+    bool ok = false;
+    if (S_ISREG(st.st_mode)) {
+        out = openat(dst_fd, dst, O_WRONLY | O_CREAT | O_EXCL, 0600);
+        ok = out >= 0 && copy_data(in, out);
+    } else {
+        // The directory stays writable until everything is in it.
+        DIR *dir = NULL;
+        if (mkdirat(dst_fd, dst, 0700) == 0 &&
+                (out = openat(dst_fd, dst, O_RDONLY | O_DIRECTORY)) >= 0 &&
+                (dir = fdopendir(in)) != NULL) {
+            in = -1;
+            ok = true;
+            struct dirent *entry;
+            while (ok && (entry = readdir(dir)) != NULL) {
+                if (strcmp(entry->d_name, ".") != 0 &&
+                        strcmp(entry->d_name, "..") != 0) {
+                    ok = copy_tree(dirfd(dir), entry->d_name, out,
+                                   entry->d_name);
+                }
+            }
+        }
+        int saved = errno;
+        if (dir != NULL) {
+            closedir(dir);
+        }
+        errno = saved;
+    }
+    if (ok) {
+        copy_attributes(out, &st);
+    }
+    int saved = errno;
+    if (in >= 0) {
+        close(in);
+    }
+    if (out >= 0) {
+        close(out);
+    }
+    errno = saved;
+    return ok;
+}
+
+/**
+ * Moves path into the junk directory under its last name component,
+ * replacing anything junked before under the same name, as mv does. Moving
+ * across filesystems copies the file and then removes the original, which
+ * is left alone if the copy fails.
+ * Returns false after printing an error on failure.
+ */
+bool junk_file(const char *path) {
+    size_t end = strlen(path);
+    while (end > 1 && path[end - 1] == '/') {
+        end--;
+    }
+    size_t start = end;
+    while (start > 0 && path[start - 1] != '/') {
+        start--;
+    }
+    char *name = strndup(path + start, end - start);
+    if (name == NULL) {
+        fprintf(stderr, "Error: strndup() failed. %s.\n", strerror(errno));
+        return false;
+    }
+
+    bool ok = false;
+    struct stat st;
+    if (name[0] == '\0' || strcmp(name, "/") == 0 ||
+            strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+        errno = EINVAL;
+    } else if (renameat(AT_FDCWD, path, junk_fd, name) == 0) {
+        ok = true;
+    } else if (errno == EXDEV &&
+            fstatat(AT_FDCWD, path, &st, AT_SYMLINK_NOFOLLOW) == 0 &&
+            clear_target(junk_fd, name, S_ISDIR(st.st_mode))) {
+        if (copy_tree(AT_FDCWD, path, junk_fd, name)) {
+            ok = remove_tree(AT_FDCWD, path);
+        } else {
+            int saved = errno;
+            remove_tree(junk_fd, name);
+            errno = saved;
+        }
+    }
+    if (!ok) {
+        fprintf(stderr, "Error: Cannot junk '%s'. %s.\n", path,
+                strerror(errno));
+    }
+    free(name);
+    return ok;
+}
+
+void display_usage(const char *program) {
+    fprintf(stderr, "Usage: %s [-0] <junk directory> [--] [files...]\n"
+            "    -0: Also junk the NUL-separated files read from stdin.\n",
+            program);
+}
+
+int main(int argc, char *argv[]) {
+    bool from_stdin = false;
+    int retval = EXIT_SUCCESS, opt;
+    while ((opt = getopt(argc, argv, "0")) != -1) {
+        if (opt != '0') {
+            display_usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+        from_stdin = true;
+    }
+    if (optind >= argc) {
+        display_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    if ((junk_fd = open(argv[optind], O_RDONLY | O_DIRECTORY)) < 0) {
+        fprintf(stderr, "Error: Cannot open junk directory '%s'. %s.\n",
+                argv[optind], strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    for (int i = optind + 1; i < argc; i++) {
+        if (!junk_file(argv[i])) {
+            retval = EXIT_FAILURE;
+        }
+    }
+
+    // Names from stdin may hold any byte but NUL, new lines included.
+    if (from_stdin) {
+        char *name = NULL;
+        size_t cap = 0;
+        while (getdelim(&name, &cap, '\0', stdin) > 0) {
+            if (name[0] != '\0' && !junk_file(name)) {
+                retval = EXIT_FAILURE;
+            }
+        }
+        if (ferror(stdin)) {
+            fprintf(stderr, "Error: Failed to read file names. %s.\n",
+                    strerror(errno));
+            retval = EXIT_FAILURE;
+        }
+        free(name);
+    }
+    close(junk_fd);
+    return retval;
+}
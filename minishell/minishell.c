@@ -5,40 +5,1236 @@
  ******************************************************************************/
 
 #include <errno.h>
+#include <fcntl.h>
 #include <limits.h>
 #include <pwd.h>
 #include <setjmp.h>
 #include <signal.h>
+#include <spawn.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <termios.h>
+#include <time.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
 #define BRIGHTBLUE "\x1b[34;1m"
 #define DEFAULT "\x1b[0m"
+#define HASH_BUCKETS 256
+#define DEFAULT_PATH "/bin:/usr/bin"
+#define READ_BUF_SIZE 65536
+#define ARENA_BLOCK_SIZE 8192
+#define ARENA_ALIGN sizeof(void *)
+
+extern char **environ;
 
 volatile sig_atomic_t signal_val = 0;
+volatile sig_atomic_t interrupted = 0;
 sigjmp_buf jmpbuf;
 
+/**
+ * Bump allocator for everything parsed from one line. Nothing is freed on
+ * its own: arena_reset() releases the whole command at once.
+ */
+typedef struct arena_block {
+    struct arena_block *next;
+    size_t size;
+    size_t used;
+    char data[];
+} arena_block;
+
+typedef struct arena {
+    arena_block *blocks;
+} arena;
+
+/**
+ * A word or an operator. Quoted text is never an operator, so "|" is a word.
+ */
+typedef struct token {
+    char *text;
+    bool is_operator;
+} token;
+
+/**
+ * One stage of a pipeline. argv points into the pipeline's tokens.
+ */
+typedef struct command {
+    char **argv;
+    int argc;
+    char *in_file;          // < file
+    char *out_file;         // > file or >> file
+    bool append;
+} command;
+
+typedef struct pipeline {
+    token *tokens;
+    int num_tokens;
+    command *cmds;
+    int num_cmds;
+    bool background;        // ends with &
+} pipeline;
+
+/**
+ * A running command of the parallel builtin. argv is one allocation holding
+ * the pointers and the strings, with {} replaced by the input line.
+ */
+typedef struct parallel_slot {
+    pid_t pid;              // 0 when the slot is free
+    char **argv;
+    const char *arg;        // the input line, inside argv
+} parallel_slot;
+
+/**
+ * A pipeline running in the background. pids[i] is set to 0 once the stage
+ * has been reaped by catch_child().
+ */
+typedef struct job {
+    int id;
+    pid_t pgid;
+    pid_t *pids;
+    int num_pids;
+    int running;            // stages not yet reaped
+    int status;             // exit status of the last stage
+    char *command;
+} job;
+
+/**
+ * Remembered location of a command, like bash's hash table, so that $PATH is
+ * only searched the first time a command is run.
+ */
+typedef struct hash_entry {
+    char *name;
+    char *path;
+    int hits;
+    struct hash_entry *next;
+} hash_entry;
+
+/**
+ * Buffered reader that hands out one line at a time, however long, from a
+ * file descriptor or, for -c, from a string.
+ */
+typedef struct line_reader {
+    int fd;                 // -1 when reading from a string
+    char *buf;
+    size_t start;
+    size_t end;
+    char *line;
+    size_t line_cap;
+} line_reader;
+
+hash_entry *command_table[HASH_BUCKETS];
+
+// SIGCHLD is blocked except while the shell is idle: reading a line or
+// suspended in wait or fg. No foreground child exists at those points, so
+// catch_child() only ever reaps background jobs. The job table is only
+// changed with SIGCHLD blocked.
+job *jobs = NULL;
+int num_jobs = 0, jobs_cap = 0;
+sigset_t sigchld_mask;      // just SIGCHLD
+sigset_t idle_mask;         // the shell's mask without SIGCHLD
+char *hashed_path_var = NULL;   // value of $PATH the table was filled from
+
 void catch_signal(int sig){
     if(signal_val == 0){
         write(STDOUT_FILENO, "\n", 1);
         signal_val = 1;
         siglongjmp(jmpbuf, 1);
     }
-    
+    interrupted = 1;
+}
+
+/**
+ * Records that pid exited. Called from catch_child(), or with SIGCHLD
+ * blocked when parallel reaps a background job's child.
+ */
+void mark_reaped(pid_t pid, int status){
+    for (int i = 0; i < num_jobs; ++i){
+        for (int j = 0; j < jobs[i].num_pids; ++j){
+            if (jobs[i].pids[j] == pid){
+                jobs[i].pids[j] = 0;
+                --jobs[i].running;
+                if (j == jobs[i].num_pids - 1){
+                    jobs[i].status = WIFEXITED(status) ? WEXITSTATUS(status) :
+                                     128 + WTERMSIG(status);
+                }
+                return;
+            }
+        }
+    }
+}
+
+/**
+ * SIGCHLD handler. Reaps every child that has exited.
+ */
+void catch_child(int sig){
+    int saved_errno = errno;
+    pid_t pid;
+    int status;
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0){
+        mark_reaped(pid, status);
+    }
+    errno = saved_errno;
+}
+
+/**
+ * Reads the next line into r->line, without its new line character.
+ * Returns 1 if a line was read, 0 at the end of the input and -1 if read()
+ * failed.
+ */
+int read_line(line_reader *r){
+    size_t len = 0;
+    bool got_data = false;
+    while (true){
+        if (r->start == r->end){
+            if (r->fd < 0){
+                break;
+            }
+            ssize_t bytes_read = read(r->fd, r->buf, READ_BUF_SIZE);
+            if (bytes_read < 0){
+                if (errno == EINTR){
+                    continue;
+                }
+                return -1;
+            }
+            if (bytes_read == 0){
+                break;
+            }
+            r->start = 0;
+            r->end = bytes_read;
+        }
+        char *data = r->buf + r->start;
+        size_t avail = r->end - r->start;
+        char *newline = memchr(data, '\n', avail);
+        size_t chunk = newline != NULL ? (size_t)(newline - data) : avail;
+        if (len + chunk + 1 > r->line_cap){
+            size_t cap = r->line_cap == 0 ? 256 : r->line_cap;
+            while (cap < len + chunk + 1){
+                cap *= 2;
+            }
+            char *line = realloc(r->line, cap);
+            if (line == NULL){
+                fprintf(stderr, "Error: realloc() failed. %s.\n", strerror(errno));
+                return -1;
+            }
+            r->line = line;
+            r->line_cap = cap;
+        }
+        memcpy(r->line + len, data, chunk);
+        len += chunk;
+        got_data = true;
+        r->start += chunk;
+        if (newline != NULL){
+            ++r->start;
+            break;
+        }
+    }
+    if (!got_data){
+        return 0;
+    }
+    r->line[len] = '\0';
+    return 1;
+}
+
+/**
+ * Sets up the reader for the command line: -c <command>, a script file, or
+ * standard input.
+ * Returns false, after printing an error, if the arguments are invalid.
+ */
+bool open_input(int argc, char *argv[], line_reader *reader){
+    memset(reader, 0, sizeof(line_reader));
+    reader->fd = STDIN_FILENO;
+    if (argc == 3 && strcmp(argv[1], "-c") == 0){
+        reader->fd = -1;
+        reader->buf = argv[2];
+        reader->end = strlen(argv[2]);
+        return true;
+    }
+    if (argc > 2 || (argc == 2 && argv[1][0] == '-')){
+        fprintf(stderr, "Usage: %s [-c <command> | <script>]\n", argv[0]);
+        return false;
+    }
+    if (argc == 2 && (reader->fd = open(argv[1], O_RDONLY | O_CLOEXEC)) < 0){
+        fprintf(stderr, "Error: Cannot open '%s'. %s.\n", argv[1],
+                strerror(errno));
+        return false;
+    }
+    if ((reader->buf = malloc(READ_BUF_SIZE)) == NULL){
+        fprintf(stderr, "Error: malloc() failed. %s.\n", strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+void close_input(line_reader *reader){
+    if (reader->fd > STDIN_FILENO){
+        close(reader->fd);
+    }
+    if (reader->fd >= 0){
+        free(reader->buf);
+    }
+    free(reader->line);
+}
+
+unsigned hash_name(const char *name){
+    unsigned hash = 5381;
+    while (*name != '\0'){
+        hash = hash * 33 + (unsigned char)*name++;
+    }
+    return hash % HASH_BUCKETS;
+}
+
+void hash_clear(){
+    for (int i = 0; i < HASH_BUCKETS; ++i){
+        hash_entry *entry = command_table[i];
+        while (entry != NULL){
+            hash_entry *next = entry->next;
+            free(entry->name);
+            free(entry->path);
+            free(entry);
+            entry = next;
+        }
+        command_table[i] = NULL;
+    }
+}
+
+void hash_remove(const char *name){
+    hash_entry **link = &command_table[hash_name(name)];
+    while (*link != NULL){
+        hash_entry *entry = *link;
+        if (strcmp(entry->name, name) == 0){
+            *link = entry->next;
+            free(entry->name);
+            free(entry->path);
+            free(entry);
+            return;
+        }
+        link = &entry->next;
+    }
+}
+
+/**
+ * Searches each directory in $PATH for an executable called name, the way
+ * execvp would. Returns a malloc'ed path, or NULL if there is none.
+ */
+char *find_in_path(const char *name){
+    const char *dir = hashed_path_var;
+    size_t name_len = strlen(name);
+    char candidate[PATH_MAX];
+    while (true){
+        size_t dir_len = strcspn(dir, ":");
+        // An empty entry means the current directory.
+        const char *prefix = dir_len == 0 ? "." : dir;
+        size_t prefix_len = dir_len == 0 ? 1 : dir_len;
+        if (prefix_len + name_len + 2 <= sizeof(candidate)){
+            memcpy(candidate, prefix, prefix_len);
+            candidate[prefix_len] = '/';
+            memcpy(candidate + prefix_len + 1, name, name_len + 1);
+            struct stat b;
+            if (access(candidate, X_OK) == 0 && stat(candidate, &b) == 0 &&
+                S_ISREG(b.st_mode)){
+                return strdup(candidate);
+            }
+        }
+        if (dir[dir_len] == '\0'){
+            return NULL;
+        }
+        dir += dir_len + 1;
+    }
+}
+
+/**
+ * Returns the path to execute for name, searching $PATH only if name has not
+ * been seen since $PATH last changed. *cached is set if the result came from
+ * the table. Returns NULL if the command cannot be found.
+ */
+const char *resolve_command(const char *name, bool *cached){
+    *cached = false;
+    if (strchr(name, '/') != NULL){
+        return name;
+    }
+    const char *path_var = getenv("PATH");
+    if (path_var == NULL){
+        path_var = DEFAULT_PATH;
+    }
+    if (hashed_path_var == NULL || strcmp(hashed_path_var, path_var) != 0){
+        hash_clear();
+        free(hashed_path_var);
+        if ((hashed_path_var = strdup(path_var)) == NULL){
+            fprintf(stderr, "Error: strdup() failed. %s.\n", strerror(errno));
+            return NULL;
+        }
+    }
+
+    unsigned bucket = hash_name(name);
+    for (hash_entry *entry = command_table[bucket]; entry != NULL;
+         entry = entry->next){
+        if (strcmp(entry->name, name) == 0){
+            ++entry->hits;
+            *cached = true;
+            return entry->path;
+        }
+    }
+
+    char *path = find_in_path(name);
+    if (path == NULL){
+        return NULL;
+    }
+    hash_entry *entry;
+    if ((entry = malloc(sizeof(hash_entry))) == NULL ||
+        (entry->name = strdup(name)) == NULL){
+        fprintf(stderr, "Error: malloc() failed. %s.\n", strerror(errno));
+        free(entry);
+        free(path);
+        return NULL;
+    }
+    entry->path = path;
+    entry->hits = 1;
+    entry->next = command_table[bucket];
+    command_table[bucket] = entry;
+    return path;
+}
+
+/**
+ * Spawns argv with the hashed location of argv[0]. If that fails, the entry
+ * may be stale (the program moved or was removed), so it is dropped and
+ * $PATH is searched once more. If pgid is not -1, the child is put in that
+ * process group, or a new one if it is 0. The child never inherits the
+ * shell's blocked SIGCHLD.
+ * Returns 0 or an errno value, like posix_spawn.
+ */
+int spawn_command(pid_t *pid, char **argv,
+                  const posix_spawn_file_actions_t *actions, pid_t pgid){
+    bool cached;
+    const char *path = resolve_command(argv[0], &cached);
+    if (path == NULL){
+        return ENOENT;
+    }
+    posix_spawnattr_t attr;
+    posix_spawnattr_init(&attr);
+    sigset_t empty;
+    sigemptyset(&empty);
+    posix_spawnattr_setsigmask(&attr, &empty);
+    short flags = POSIX_SPAWN_SETSIGMASK;
+    if (pgid != -1){
+        posix_spawnattr_setpgroup(&attr, pgid);
+        flags |= POSIX_SPAWN_SETPGROUP;
+    }
+    posix_spawnattr_setflags(&attr, flags);
+    int err = posix_spawn(pid, path, actions, &attr, argv, environ);
+    if (err != 0 && cached){
+        hash_remove(argv[0]);
+        if ((path = resolve_command(argv[0], &cached)) == NULL){
+            return ENOENT;
+        }
+        err = posix_spawn(pid, path, actions, &attr, argv, environ);
+    }
+    posix_spawnattr_destroy(&attr);
+    if (err != 0 && strchr(argv[0], '/') == NULL){
+        hash_remove(argv[0]);
+    }
+    return err;
+}
+
+/**
+ * The hash builtin. With no arguments, lists the remembered commands; -r
+ * forgets them all; otherwise looks up and remembers each name.
+ */
+int hash_builtin(int argc, char **argv){
+    if (argc == 2 && strcmp(argv[1], "-r") == 0){
+        hash_clear();
+        return EXIT_SUCCESS;
+    }
+    if (argc > 1){
+        int result = EXIT_SUCCESS;
+        for (int i = 1; i < argc; ++i){
+            bool cached;
+            if (resolve_command(argv[i], &cached) == NULL){
+                fprintf(stderr, "Error: hash: '%s' not found.\n", argv[i]);
+                result = EXIT_FAILURE;
+            }
+        }
+        return result;
+    }
+    bool empty = true;
+    for (int i = 0; i < HASH_BUCKETS; ++i){
+        for (hash_entry *entry = command_table[i]; entry != NULL;
+             entry = entry->next){
+            if (empty){
+                printf("hits\tcommand\n");
+                empty = false;
+            }
+            printf("%4d\t%s\n", entry->hits, entry->path);
+        }
+    }
+    if (empty){
+        printf("hash: hash table empty\n");
+    }
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Adds a background job, taking ownership of pids. Called with SIGCHLD
+ * blocked, before any of its stages can have been reaped.
+ */
+job *add_job(pid_t *pids, int num_pids, const char *command, size_t len){
+    if (num_jobs == jobs_cap){
+        int cap = jobs_cap == 0 ? 16 : jobs_cap * 2;
+        job *grown = realloc(jobs, cap * sizeof(job));
+        if (grown == NULL){
+            fprintf(stderr, "Error: realloc() failed. %s.\n", strerror(errno));
+            return NULL;
+        }
+        jobs = grown;
+        jobs_cap = cap;
+    }
+    job *j = &jobs[num_jobs];
+    j->id = num_jobs == 0 ? 1 : jobs[num_jobs - 1].id + 1;
+    j->pgid = -1;
+    j->pids = pids;
+    j->num_pids = num_pids;
+    j->running = 0;
+    j->status = EXIT_FAILURE;
+    for (int i = 0; i < num_pids; ++i){
+        if (pids[i] > 0){
+            ++j->running;
+            if (j->pgid == -1){
+                j->pgid = pids[i];
+            }
+        }
+    }
+    if ((j->command = strndup(command, len)) == NULL){
+        fprintf(stderr, "Error: strndup() failed. %s.\n", strerror(errno));
+        return NULL;
+    }
+    ++num_jobs;
+    return j;
+}
+
+void remove_job(int index){
+    free(jobs[index].pids);
+    free(jobs[index].command);
+    memmove(&jobs[index], &jobs[index + 1],
+            (num_jobs - index - 1) * sizeof(job));
+    --num_jobs;
+}
+
+/**
+ * Finds a job by "%n" or "n", or the most recent job if spec is NULL.
+ * Returns its index, or -1 after printing an error.
+ */
+int find_job(const char *builtin, const char *spec){
+    if (spec == NULL){
+        if (num_jobs == 0){
+            fprintf(stderr, "Error: %s: No current job.\n", builtin);
+        }
+        return num_jobs - 1;
+    }
+    int id = atoi(spec[0] == '%' ? spec + 1 : spec);
+    for (int i = 0; i < num_jobs; ++i){
+        if (jobs[i].id == id){
+            return i;
+        }
+    }
+    fprintf(stderr, "Error: %s: No such job '%s'.\n", builtin, spec);
+    return -1;
+}
+
+void print_job(job *j){
+    if (j->running > 0){
+        printf("[%d]  %-10s %s\n", j->id, "Running", j->command);
+    }else if (j->status == EXIT_SUCCESS){
+        printf("[%d]  %-10s %s\n", j->id, "Done", j->command);
+    }else{
+        printf("[%d]  Exit %-5d %s\n", j->id, j->status, j->command);
+    }
+}
+
+/**
+ * Forgets the jobs that have finished, printing them first when there is a
+ * person at the terminal to tell.
+ */
+void report_jobs(bool interactive){
+    for (int i = 0; i < num_jobs; ++i){
+        if (jobs[i].running == 0){
+            if (interactive){
+                print_job(&jobs[i]);
+            }
+            remove_job(i--);
+        }
+    }
+    fflush(stdout);
 }
 
-int main(){
+/**
+ * Suspends until every stage of the job has been reaped, or SIGINT arrives.
+ * Returns the job's status, or -1 if it was interrupted.
+ */
+int wait_for_job(job *j){
+    interrupted = 0;
+    while (j->running > 0 && !interrupted){
+        sigsuspend(&idle_mask);
+    }
+    return j->running > 0 ? -1 : j->status;
+}
+
+int jobs_builtin(){
+    for (int i = 0; i < num_jobs; ++i){
+        print_job(&jobs[i]);
+        if (jobs[i].running == 0){
+            remove_job(i--);
+        }
+    }
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Waits for the given jobs, or all of them. Returns the status of the last
+ * job waited for.
+ */
+int wait_builtin(int argc, char **argv){
+    int result = EXIT_SUCCESS;
+    if (argc == 1){
+        while (num_jobs > 0){
+            if ((result = wait_for_job(&jobs[0])) == -1){
+                return EXIT_FAILURE;
+            }
+            remove_job(0);
+        }
+        return result;
+    }
+    for (int i = 1; i < argc; ++i){
+        int index = find_job("wait", argv[i]);
+        if (index == -1){
+            result = EXIT_FAILURE;
+            continue;
+        }
+        if ((result = wait_for_job(&jobs[index])) == -1){
+            return EXIT_FAILURE;
+        }
+        remove_job(index);
+    }
+    return result;
+}
+
+/**
+ * Brings a job to the foreground: gives it the terminal, continues it in
+ * case it stopped on terminal input, and waits for it.
+ */
+int fg_builtin(int argc, char **argv, bool interactive){
+    if (argc > 2){
+        fprintf(stderr, "Error: Too many arguments to fg.\n");
+        return EXIT_FAILURE;
+    }
+    int index = find_job("fg", argc == 2 ? argv[1] : NULL);
+    if (index == -1){
+        return EXIT_FAILURE;
+    }
+    job *j = &jobs[index];
+    printf("%s\n", j->command);
+    fflush(stdout);
+    if (j->pgid == -1){
+        remove_job(index);
+        return EXIT_FAILURE;
+    }
+    if (interactive){
+        tcsetpgrp(STDIN_FILENO, j->pgid);
+    }
+    kill(-j->pgid, SIGCONT);
+    int result;
+    while ((result = wait_for_job(j)) == -1){
+        // Without the terminal the shell gets the SIGINT, so pass it on.
+        kill(-j->pgid, SIGINT);
+    }
+    if (interactive){
+        // The shell is now in the background, so taking the terminal back
+        // would raise SIGTTOU unless it is blocked.
+        sigset_t ttou, prev;
+        sigemptyset(&ttou);
+        sigaddset(&ttou, SIGTTOU);
+        sigprocmask(SIG_BLOCK, &ttou, &prev);
+        tcsetpgrp(STDIN_FILENO, getpgrp());
+        sigprocmask(SIG_SETMASK, &prev, NULL);
+    }
+    remove_job(index);
+    return result;
+}
+
+bool is_builtin(const char *name){
+    return strcmp(name, "cd") == 0 || strcmp(name, "exit") == 0 ||
+           strcmp(name, "hash") == 0 || strcmp(name, "jobs") == 0 ||
+           strcmp(name, "wait") == 0 || strcmp(name, "fg") == 0 ||
+           strcmp(name, "parallel") == 0;
+}
+
+bool is_op(const token *t, const char *op){
+    return t->is_operator && strcmp(t->text, op) == 0;
+}
+
+/**
+ * Returns size bytes from the arena, or NULL if a new block could not be
+ * allocated.
+ */
+void *arena_alloc(arena *a, size_t size){
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    arena_block *b = a->blocks;
+    if (b == NULL || b->size - b->used < size){
+        size_t block_size = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+        if ((b = malloc(sizeof(arena_block) + block_size)) == NULL){
+            fprintf(stderr, "Error: malloc() failed. %s.\n", strerror(errno));
+            return NULL;
+        }
+        b->next = a->blocks;
+        b->size = block_size;
+        b->used = 0;
+        a->blocks = b;
+    }
+    void *ptr = b->data + b->used;
+    b->used += size;
+    return ptr;
+}
+
+/**
+ * Releases everything allocated since the last reset. The last block is
+ * kept, so ordinary lines never reach malloc() at all.
+ */
+void arena_reset(arena *a){
+    if (a->blocks == NULL){
+        return;
+    }
+    while (a->blocks->next != NULL){
+        arena_block *next = a->blocks->next;
+        free(a->blocks);
+        a->blocks = next;
+    }
+    a->blocks->used = 0;
+}
+
+void arena_free(arena *a){
+    arena_reset(a);
+    free(a->blocks);
+    a->blocks = NULL;
+}
+
+/**
+ * Splits line into words and the operators |, <, >, >> and &, which do not
+ * need to be surrounded by spaces. Double quotes group text, spaces and
+ * operators included, into one word and are removed. All words are copied
+ * into a single arena buffer: a word and its NUL never take more room than
+ * the word and the character after it took in the line.
+ * Returns false, after printing an error, on an unmatched quote.
+ */
+bool tokenize(const char *line, pipeline *pl, arena *a){
+    // No line can have more tokens than characters.
+    size_t len = strlen(line);
+    char *dst = arena_alloc(a, len + 1);
+    pl->tokens = arena_alloc(a, (len + 1) * sizeof(token));
+    if (dst == NULL || pl->tokens == NULL){
+        return false;
+    }
+    const char *p = line;
+    while (true){
+        p += strspn(p, " \t");
+        if (*p == '\0'){
+            break;
+        }
+        token *t = &pl->tokens[pl->num_tokens++];
+        if (*p == '|' || *p == '<' || *p == '&' || *p == '>'){
+            t->is_operator = true;
+            if (*p == '>' && *(p + 1) == '>'){
+                t->text = ">>";
+                p += 2;
+            }else{
+                t->text = *p == '|' ? "|" : *p == '<' ? "<" : *p == '&' ? "&" : ">";
+                ++p;
+            }
+            continue;
+        }
+        t->is_operator = false;
+        t->text = dst;
+        bool in_quotes = false;
+        for (; *p != '\0' && (in_quotes || strchr(" \t|<>&", *p) == NULL); ++p){
+            if (*p == '"'){
+                in_quotes = !in_quotes;
+            }else{
+                *dst++ = *p;
+            }
+        }
+        if (in_quotes){
+            fprintf(stderr, "Error: Malformed command.\n");
+            return false;
+        }
+        *dst++ = '\0';
+    }
+    return true;
+}
+
+/**
+ * Parses line into a pipeline of commands with their redirections, all
+ * allocated from a.
+ * Returns false, after printing an error, if the line is malformed.
+ */
+bool parse_pipeline(const char *line, pipeline *pl, arena *a){
+    memset(pl, 0, sizeof(pipeline));
+    if (!tokenize(line, pl, a)){
+        return false;
+    }
+    if (pl->num_tokens == 0){
+        return true;
+    }
+    if (is_op(&pl->tokens[pl->num_tokens - 1], "&")){
+        pl->background = true;
+        if (--pl->num_tokens == 0){
+            fprintf(stderr, "Error: Malformed command.\n");
+            return false;
+        }
+    }
+    int max_cmds = 1;
+    for (int i = 0; i < pl->num_tokens; ++i){
+        if (is_op(&pl->tokens[i], "|")){
+            ++max_cmds;
+        }
+    }
+    // Every word lands in exactly one argv, each of which also needs a NULL.
+    char **argv_space = arena_alloc(a, (pl->num_tokens + max_cmds) * sizeof(char *));
+    if ((pl->cmds = arena_alloc(a, max_cmds * sizeof(command))) == NULL ||
+        argv_space == NULL){
+        return false;
+    }
+    memset(pl->cmds, 0, max_cmds * sizeof(command));
+
+    command *cmd = NULL;
+    for (int i = 0; i < pl->num_tokens; ++i){
+        token *t = &pl->tokens[i];
+        if (cmd == NULL){
+            cmd = &pl->cmds[pl->num_cmds++];
+            cmd->argv = argv_space;
+        }
+        if (is_op(t, "|")){
+            if (cmd->argc == 0){
+                fprintf(stderr, "Error: Malformed command.\n");
+                return false;
+            }
+            argv_space += cmd->argc + 1;
+            cmd = NULL;
+        }else if (is_op(t, "&")){
+            fprintf(stderr, "Error: Malformed command.\n");
+            return false;
+        }else if (t->is_operator){
+            if (i + 1 == pl->num_tokens || pl->tokens[i + 1].is_operator){
+                fprintf(stderr, "Error: Missing file name after '%s'.\n", t->text);
+                return false;
+            }
+            if (is_op(t, "<")){
+                cmd->in_file = pl->tokens[++i].text;
+            }else{
+                cmd->out_file = pl->tokens[++i].text;
+                cmd->append = is_op(t, ">>");
+            }
+        }else{
+            cmd->argv[cmd->argc++] = t->text;
+        }
+        if (cmd != NULL){
+            cmd->argv[cmd->argc] = NULL;
+        }
+    }
+    if (cmd == NULL || cmd->argc == 0){
+        fprintf(stderr, "Error: Malformed command.\n");
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Opens the redirection files of cmd. The descriptors are close-on-exec;
+ * posix_spawn's dup2 onto 0 and 1 clears the flag on the copies.
+ */
+bool open_redirections(command *cmd, int *in_fd, int *out_fd){
+    if (cmd->in_file != NULL){
+        if ((*in_fd = open(cmd->in_file, O_RDONLY | O_CLOEXEC)) < 0){
+            fprintf(stderr, "Error: Cannot open '%s'. %s.\n", cmd->in_file,
+                    strerror(errno));
+            return false;
+        }
+    }
+    if (cmd->out_file != NULL){
+        int flags = O_WRONLY | O_CREAT | O_CLOEXEC |
+                    (cmd->append ? O_APPEND : O_TRUNC);
+        if ((*out_fd = open(cmd->out_file, flags, 0644)) < 0){
+            fprintf(stderr, "Error: Cannot open '%s'. %s.\n", cmd->out_file,
+                    strerror(errno));
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Starts every stage of the pipeline with posix_spawn, which glibc
+ * implements with a vfork-style clone, so the shell's address space is not
+ * copied, and waits for all of them. A background pipeline gets its own
+ * process group, so SIGINT from the terminal does not reach it, and is added
+ * to the job table instead of being waited for.
+ * Returns the exit status of the last stage, or -1 on failure.
+ */
+int run_pipeline(pipeline *pl, const char *line){
+    pid_t *pids;
+    if ((pids = malloc(pl->num_cmds * sizeof(pid_t))) == NULL){
+        fprintf(stderr, "Error: malloc() failed. %s.\n", strerror(errno));
+        return -1;
+    }
+    for (int i = 0; i < pl->num_cmds; ++i){
+        pids[i] = -1;
+    }
+    // Anything the shell printed itself must come out before the children's
+    // output.
+    fflush(stdout);
+    int result = EXIT_SUCCESS;
+    int prev_read = -1;
+    // A background pipeline's group is led by its first stage that started.
+    pid_t leader = 0;
+    for (int i = 0; i < pl->num_cmds; ++i){
+        command *cmd = &pl->cmds[i];
+        int pipefd[2] = {-1, -1};
+        if (i < pl->num_cmds - 1){
+            if (pipe(pipefd) < 0){
+                fprintf(stderr, "Error: pipe() failed. %s.\n", strerror(errno));
+                result = -1;
+                break;
+            }
+            fcntl(pipefd[0], F_SETFD, FD_CLOEXEC);
+            fcntl(pipefd[1], F_SETFD, FD_CLOEXEC);
+        }
+
+        int in_fd = prev_read, out_fd = pipefd[1];
+        int file_in = -1, file_out = -1;
+        if (open_redirections(cmd, &file_in, &file_out)){
+            if (file_in != -1){
+                in_fd = file_in;
+            }
+            if (file_out != -1){
+                out_fd = file_out;
+            }
+            posix_spawn_file_actions_t actions;
+            posix_spawn_file_actions_init(&actions);
+            if (in_fd != -1){
+                posix_spawn_file_actions_adddup2(&actions, in_fd, STDIN_FILENO);
+            }
+            if (out_fd != -1){
+                posix_spawn_file_actions_adddup2(&actions, out_fd, STDOUT_FILENO);
+            }
+            pid_t pgid = pl->background ? leader : -1;
+            int err = spawn_command(&pids[i], cmd->argv, &actions, pgid);
+            posix_spawn_file_actions_destroy(&actions);
+            if (err != 0){
+                fprintf(stderr, "Error: exec() failed. %s.\n", strerror(err));
+                pids[i] = -1;
+            }else if (leader == 0){
+                leader = pids[i];
+            }
+        }
+        if (pids[i] == -1 && i == pl->num_cmds - 1){
+            result = EXIT_FAILURE;
+        }
+        if (file_in != -1){
+            close(file_in);
+        }
+        if (file_out != -1){
+            close(file_out);
+        }
+        if (prev_read != -1){
+            close(prev_read);
+        }
+        if (pipefd[1] != -1){
+            close(pipefd[1]);
+        }
+        prev_read = pipefd[0];
+    }
+    if (prev_read != -1){
+        close(prev_read);
+    }
+
+    if (pl->background && leader == 0){
+        // Nothing started, so there is no job to track.
+        free(pids);
+        return result == -1 ? -1 : EXIT_FAILURE;
+    }
+    if (pl->background && result != -1){
+        // The command text is the line without its trailing '&'.
+        line += strspn(line, " \t");
+        size_t len = strrchr(line, '&') - line;
+        while (len > 0 && (line[len - 1] == ' ' || line[len - 1] == '\t')){
+            --len;
+        }
+        job *j = add_job(pids, pl->num_cmds, line, len);
+        if (j == NULL){
+            free(pids);
+            return -1;
+        }
+        printf("[%d] %d\n", j->id, (int)j->pgid);
+        return result;
+    }
+
+    for (int i = 0; i < pl->num_cmds; ++i){
+        if (pids[i] <= 0){
+            continue;
+        }
+        int status;
+        if (waitpid(pids[i], &status, 0) == -1){
+            fprintf(stderr, "Error: wait() failed. %s.\n", strerror(errno));
+            result = -1;
+            continue;
+        }
+        if (i == pl->num_cmds - 1 && result != -1){
+            result = WIFEXITED(status) ? WEXITSTATUS(status) : EXIT_FAILURE;
+        }
+    }
+    free(pids);
+    return result;
+}
+
+/**
+ * Builds the argv for one input line: every {} in the template is replaced
+ * by arg, or arg is appended if the template has no {}.
+ * Returns NULL if memory could not be allocated.
+ */
+char **expand_template(char **tmpl, int tmpl_argc, const char *arg,
+                       const char **arg_copy){
+    size_t arg_len = strlen(arg);
+    bool substituted = false;
+    size_t size = 0;
+    for (int i = 0; i < tmpl_argc; ++i){
+        size += strlen(tmpl[i]) + 1;
+        for (const char *p = tmpl[i]; (p = strstr(p, "{}")) != NULL; p += 2){
+            size += arg_len - 2;
+            substituted = true;
+        }
+    }
+    int argc = tmpl_argc + (substituted ? 0 : 1);
+    size += (argc + 1) * sizeof(char *) + arg_len + 1;
+    char **argv = malloc(size);
+    if (argv == NULL){
+        fprintf(stderr, "Error: malloc() failed. %s.\n", strerror(errno));
+        return NULL;
+    }
+    char *dst = (char *)(argv + argc + 1);
+    for (int i = 0; i < tmpl_argc; ++i){
+        argv[i] = dst;
+        const char *p = tmpl[i], *brace;
+        while ((brace = strstr(p, "{}")) != NULL){
+            memcpy(dst, p, brace - p);
+            dst += brace - p;
+            memcpy(dst, arg, arg_len);
+            dst += arg_len;
+            p = brace + 2;
+        }
+        dst = stpcpy(dst, p) + 1;
+    }
+    *arg_copy = strcpy(dst, arg);
+    if (!substituted){
+        argv[tmpl_argc] = dst;
+    }
+    argv[argc] = NULL;
+    return argv;
+}
+
+/**
+ * Marks the parallel command with the given pid as finished, reporting it
+ * if it failed.
+ * Returns true if pid was one of the slots.
+ */
+bool reap_slot(parallel_slot *slots, int num_slots, pid_t pid, int status,
+               long *failed){
+    for (int i = 0; i < num_slots; ++i){
+        if (slots[i].pid == pid){
+            int code = WIFEXITED(status) ? WEXITSTATUS(status) :
+                       128 + WTERMSIG(status);
+            if (code != EXIT_SUCCESS){
+                fprintf(stderr, "parallel: '%s' exited with status %d.\n",
+                        slots[i].arg, code);
+                ++*failed;
+            }
+            free(slots[i].argv);
+            slots[i].argv = NULL;
+            slots[i].pid = 0;
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * parallel [-j N] command [args...] < list
+ * Runs the command once per line of the list, with {} replaced by the line,
+ * keeping up to N (default: one per CPU) running at once. A new command is
+ * started as soon as one finishes. The list is read from standard input only
+ * when the shell is not reading its own commands from there.
+ * Returns EXIT_FAILURE if any command failed.
+ */
+int parallel_builtin(command *cmd, bool stdin_free){
+    long max_jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    int first = 1;
+    if (cmd->argc > 1 && strcmp(cmd->argv[1], "-j") == 0){
+        if (cmd->argc < 3){
+            fprintf(stderr, "Usage: parallel [-j N] command [args...] < list\n");
+            return EXIT_FAILURE;
+        }
+        char *end;
+        errno = 0;
+        max_jobs = strtol(cmd->argv[2], &end, 10);
+        if (errno != 0 || *end != '\0' || max_jobs < 1 || max_jobs > 4096){
+            fprintf(stderr, "Error: Invalid job count '%s'.\n", cmd->argv[2]);
+            return EXIT_FAILURE;
+        }
+        first = 3;
+    }
+    if (max_jobs < 1){
+        max_jobs = 1;
+    }
+    if (first >= cmd->argc){
+        fprintf(stderr, "Usage: parallel [-j N] command [args...] < list\n");
+        return EXIT_FAILURE;
+    }
+    if (cmd->in_file == NULL && !stdin_free){
+        fprintf(stderr, "Error: parallel needs its list from '<' here.\n");
+        return EXIT_FAILURE;
+    }
+
+    int in_fd = STDIN_FILENO, out_fd = -1;
+    if (!open_redirections(cmd, &in_fd, &out_fd)){
+        if (in_fd != STDIN_FILENO){
+            close(in_fd);
+        }
+        return EXIT_FAILURE;
+    }
+    line_reader list;
+    memset(&list, 0, sizeof(line_reader));
+    list.fd = in_fd;
+    parallel_slot *slots = calloc(max_jobs, sizeof(parallel_slot));
+    if ((list.buf = malloc(READ_BUF_SIZE)) == NULL || slots == NULL){
+        fprintf(stderr, "Error: malloc() failed. %s.\n", strerror(errno));
+        free(slots);
+        close_input(&list);
+        if (out_fd != -1){
+            close(out_fd);
+        }
+        return EXIT_FAILURE;
+    }
+
+    // Every command gets /dev/null as input, so none of them can eat the
+    // list or the shell's own commands, and shares the > file if any.
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null",
+                                     O_RDONLY, 0);
+    if (out_fd != -1){
+        posix_spawn_file_actions_adddup2(&actions, out_fd, STDOUT_FILENO);
+    }
+    fflush(stdout);
+
+    struct timespec start, finish;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    long started = 0, failed = 0;
+    int running = 0;
+    bool more = true;
+    interrupted = 0;
+    while (true){
+        // Fill every free slot before waiting.
+        for (int i = 0; more && !interrupted && i < max_jobs; ++i){
+            if (slots[i].pid != 0){
+                continue;
+            }
+            int got = read_line(&list);
+            if (got <= 0){
+                if (got < 0){
+                    fprintf(stderr, "Error: read() failed. %s.\n", strerror(errno));
+                    ++failed;
+                }
+                more = false;
+                break;
+            }
+            if (list.line[0] == '\0'){
+                --i;
+                continue;
+            }
+            slots[i].argv = expand_template(cmd->argv + first, cmd->argc - first,
+                                            list.line, &slots[i].arg);
+            if (slots[i].argv == NULL){
+                more = false;
+                ++failed;
+                break;
+            }
+            ++started;
+            int err = spawn_command(&slots[i].pid, slots[i].argv, &actions, -1);
+            if (err != 0){
+                fprintf(stderr, "Error: exec() failed. %s.\n", strerror(err));
+                free(slots[i].argv);
+                slots[i].argv = NULL;
+                slots[i].pid = 0;
+                ++failed;
+                continue;
+            }
+            ++running;
+        }
+        if (running == 0){
+            if (more && !interrupted){
+                continue; // Every command in this round failed to start.
+            }
+            break;
+        }
+        // SIGCHLD is blocked, so this cannot race with catch_child(). A
+        // background job's child reaped here is handed to the job table.
+        int status;
+        pid_t pid = waitpid(-1, &status, 0);
+        if (pid == -1){
+            if (errno == EINTR){
+                continue;
+            }
+            fprintf(stderr, "Error: wait() failed. %s.\n", strerror(errno));
+            break;
+        }
+        if (reap_slot(slots, max_jobs, pid, status, &failed)){
+            --running;
+        }else{
+            mark_reaped(pid, status);
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &finish);
+
+    double seconds = (finish.tv_sec - start.tv_sec) +
+                     (finish.tv_nsec - start.tv_nsec) / 1e9;
+    fprintf(stderr, "parallel: %ld jobs, %ld failed, %.2f s, %.1f jobs/s%s\n",
+            started, failed, seconds, seconds > 0 ? started / seconds : 0.0,
+            interrupted ? " (interrupted)" : "");
+    posix_spawn_file_actions_destroy(&actions);
+    for (int i = 0; i < max_jobs; ++i){
+        free(slots[i].argv);
+    }
+    free(slots);
+    close_input(&list);
+    if (out_fd != -1){
+        close(out_fd);
+    }
+    return failed == 0 && !interrupted ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+int main(int argc, char *argv[]){
     int retval = EXIT_SUCCESS;
-    char buf[4096]; 
     bool exit = false;
-    int argc;
-    char **argv = NULL;
-    
+    pipeline pl;
+    memset(&pl, 0, sizeof(pipeline));
+    arena parse_arena = {NULL};
+
+    line_reader reader;
+    if (!open_input(argc, argv, &reader)){
+        return EXIT_FAILURE;
+    }
+    // The prompt, and the getcwd() it needs, are only for a person at a
+    // terminal. Scripts, -c and piped input skip both.
+    bool interactive = reader.fd == STDIN_FILENO && isatty(STDIN_FILENO);
 
     struct sigaction action;
     memset(&action, 0, sizeof(struct sigaction));
@@ -50,153 +1246,122 @@ int main(){
         exit = true;
         goto EXIT;
     }
+    action.sa_handler = catch_child;
+    action.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+    if (sigaction(SIGCHLD, &action, NULL) == -1){
+        fprintf(stderr, "Error: Cannot register signal handler. %s.\n", strerror(errno));
+        retval = EXIT_FAILURE;
+        exit = true;
+        goto EXIT;
+    }
+    // SIGCHLD is blocked before sigsetjmp(), so a SIGINT that jumps back
+    // here leaves it blocked.
+    sigemptyset(&sigchld_mask);
+    sigaddset(&sigchld_mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &sigchld_mask, &idle_mask);
+    sigdelset(&idle_mask, SIGCHLD);
 
     sigsetjmp(jmpbuf, 1);
     if(signal_val == 1){
         goto EXIT;
     }
     while (true){
-        char path[PATH_MAX];
-        if (getcwd(path, sizeof(path)) == NULL){
-            fprintf(stderr, "Error: Cannot get current working directory. %s.\n", strerror(errno));
-            retval = EXIT_FAILURE;
-            goto EXIT;
-        }
-        if (buf[0] == '('){ // in getcwd It is possible we will mess up when implementing something like cd, and and the current directory will not be below the root directory of the currebt process. In this case, the returned path will be prefixed with "(unreachable)", so we must check to see if the first charactar is "(", and if it is, we should likely throw an error.
-            fprintf(stderr, "Error: Path unreachable.\n"); // I am unsure if this is the right error message, this case was not listed explicitely in "Error Handling". Maybe it should be the same thing as the previous error. However, if this happens, errno is not set up.
-            retval = EXIT_FAILURE;
-            goto EXIT;
+        arena_reset(&parse_arena);
+        memset(&pl, 0, sizeof(pipeline));
+        report_jobs(interactive);
+        if (interactive){
+            char path[PATH_MAX];
+            if (getcwd(path, sizeof(path)) == NULL){
+                fprintf(stderr, "Error: Cannot get current working directory. %s.\n", strerror(errno));
+                retval = EXIT_FAILURE;
+                goto EXIT;
+            }
+            if (path[0] == '('){ // in getcwd It is possible we will mess up when implementing something like cd, and and the current directory will not be below the root directory of the currebt process. In this case, the returned path will be prefixed with "(unreachable)", so we must check to see if the first charactar is "(", and if it is, we should likely throw an error.
+                fprintf(stderr, "Error: Path unreachable.\n"); // I am unsure if this is the right error message, this case was not listed explicitely in "Error Handling". Maybe it should be the same thing as the previous error. However, if this happens, errno is not set up.
+                retval = EXIT_FAILURE;
+                goto EXIT;
+            }
+            printf("[%s%s%s]$ ", BRIGHTBLUE, path, DEFAULT);
+            fflush(stdout);
         }
-        printf("[%s%s%s]$ ", BRIGHTBLUE, path, DEFAULT);
-        fflush(stdout);
-        
 
-        argc = 0;
-        argv = NULL;
-        memset(buf, 0, 4096);
-        ssize_t bytes_read = read(STDIN_FILENO, buf, sizeof(buf) - 1);
-        if (bytes_read < 0){
+        sigprocmask(SIG_UNBLOCK, &sigchld_mask, NULL);
+        int line_read = read_line(&reader);
+        sigprocmask(SIG_BLOCK, &sigchld_mask, NULL);
+        if (line_read < 0){
             fprintf(stderr, "Error: read() failed. %s\n", strerror(errno));
             retval = EXIT_FAILURE;
+            exit = true;
             goto EXIT;
         }
-        if (bytes_read == 0){
-            write(STDOUT_FILENO, "\n", 1);
-            retval = EXIT_FAILURE;
+        if (line_read == 0){
+            // At the end of a script, the shell exits with the last status.
+            if (interactive){
+                write(STDOUT_FILENO, "\n", 1);
+                retval = EXIT_FAILURE;
+            }
             exit = true;
             goto EXIT;
         }
-        if (bytes_read > 0){
-            buf[bytes_read - 1] = '\0';
+        char *buf = reader.line;
+        if (buf[strspn(buf, " \t")] == '#'){
+            goto EXIT; // Comment, or the #! line of a script.
         }
-        char buf3[4096];
-        strcpy(buf3, buf);
-        
-        char *s = strtok(buf, " ");
-        if(s == NULL){
+
+        if (!parse_pipeline(buf, &pl, &parse_arena)){
+            retval = EXIT_FAILURE;
             goto EXIT;
         }
-        if((argv = (char **)malloc(4096*sizeof(char *))) == NULL){
-            fprintf(stderr, "Error: malloc() failed. %s.\n", strerror(errno));
+        if (pl.num_cmds == 0){
+            goto EXIT;
+        }
+        char **cmd_argv = pl.cmds[0].argv;
+        int cmd_argc = pl.cmds[0].argc;
+        if (pl.num_cmds > 1 || pl.background){
+            for (int i = 0; i < pl.num_cmds; ++i){
+                if (is_builtin(pl.cmds[i].argv[0])){
+                    fprintf(stderr, "Error: Built-in '%s' cannot be used in a %s.\n",
+                            pl.cmds[i].argv[0],
+                            pl.num_cmds > 1 ? "pipeline" : "background job");
+                    retval = EXIT_FAILURE;
+                    goto EXIT;
+                }
+            }
+        }
+        // The built-ins run in the shell itself, and only parallel reads its
+        // redirections.
+        if (is_builtin(cmd_argv[0]) && strcmp(cmd_argv[0], "parallel") != 0 &&
+            (pl.cmds[0].in_file != NULL || pl.cmds[0].out_file != NULL)){
+            fprintf(stderr, "Error: Built-in '%s' cannot be redirected.\n",
+                    cmd_argv[0]);
             retval = EXIT_FAILURE;
             goto EXIT;
         }
-        do{
-            if ((argv[argc] = calloc(strlen(s), sizeof(char))) == NULL){
-                fprintf(stderr, "Error: calloc() failed. %s.\n", strerror(errno));
+        if (strcmp(cmd_argv[0], "cd") == 0){
+            // Quotes were already removed by the tokenizer, so cd "" gets an
+            // empty argument and goes home like cd with none.
+            if (cmd_argc > 2){
+                fprintf(stderr, "Error: Too many arguments to cd.\n");
                 retval = EXIT_FAILURE;
                 goto EXIT;
-            
             }
-            
-            strcpy(argv[argc], s);
-            ++argc;
-        
-        }while((s = strtok(NULL, " ")) != NULL);
-        for(int i = argc; i < sizeof(argv); ++i){
-            if(argv[i] != NULL){
-                argv[i] = NULL;
-            }
-        }
-        if (strncmp(argv[0], "cd", 3) == 0){
-            char *dir;
-            if (argc == 1 || (argc == 2 && (strncmp(argv[1], "~", 5) == 0))){ // we want cd ~sometext to error out, but cd ~ to work, because thats how the shell and borowski do it
-                if ((dir = getpwuid(getuid())->pw_dir) == NULL){
+            char home_path[PATH_MAX];
+            const char *dir = cmd_argc == 2 ? cmd_argv[1] : "";
+            if (*dir == '\0' || *dir == '~'){
+                struct passwd *pw = getpwuid(getuid());
+                if (pw == NULL){
                     fprintf(stderr, "Error: Cannot get passwd entry. %s.\n", strerror(errno));
                     retval = EXIT_FAILURE;
                     goto EXIT;
                 }
-            
-            }else {
-                char dir2[PATH_MAX];
-                int dir_size = 0;
-                bool quotes_seen = false; // if an odd number of quotes have been seen
-                int bufIndex = 3; // 0 through 2 are "cd " UNLESS THERE ARE LEADING SPACES
-                // we deal with leading spaces:
-                int bufSpaceCount = 0;
-                while (buf[bufSpaceCount] == ' '){
-                    bufSpaceCount++;
-                    bufIndex++;
-                }
-                // now we need to check for spaces between cd and the path
-                while (buf[bufIndex] == ' '){
-                    bufIndex++;
-                }
-                
-                //now we build up dir2 to hold the path
-                while (buf3[bufIndex] != '\0') {
-                    if (buf3[bufIndex] == '"') {
-                        quotes_seen = !quotes_seen;
-                    } else if (buf3[bufIndex] == ' ') {
-                        if (!quotes_seen) {
-                            // at this point we've seen a space after an even number of quotes, so we either have too many args, or we've seen a trailing space, lets find out which
-                            while (buf3[++bufIndex] == ' ');
-                            if (buf3[bufIndex] == '\0'){
-                                break;
-                            } else {
-                                fprintf(stderr, "Error: Too many arguments to cd.\n");
-                                retval = EXIT_FAILURE;
-                                goto EXIT;
-                            }
-                        } else {
-                            dir2[dir_size++] = ' ';
-                        }
-                    } else {
-                        dir2[dir_size++] = buf3[bufIndex];
-                    }
-                    bufIndex++;
-                }
-                
-                
-                if (quotes_seen){
-                    fprintf(stderr, "Error: Malformed command.\n");
+                const char *rest = *dir == '~' ? dir + 1 : dir;
+                if (snprintf(home_path, sizeof(home_path), "%s%s", pw->pw_dir,
+                             rest) >= (int)sizeof(home_path)){
+                    fprintf(stderr, "Error: Path is too long.\n");
                     retval = EXIT_FAILURE;
                     goto EXIT;
                 }
-                strncpy(dir2+dir_size, "\0", 1);
-                dir_size++;
-                
-                if(!strncmp(dir2,"~",1) && strlen(dir2) >= 1){
-                    if ((dir = getpwuid(getuid())->pw_dir) == NULL){
-                        fprintf(stderr, "Error: Cannot get passwd entry. %s.\n", strerror(errno));
-                        retval = EXIT_FAILURE;
-                        goto EXIT;
-                    }
-                    memmove(dir2,dir2+1,strlen(dir2));
-                    strcat(dir,dir2);
-                
-                }else{
-                
-                    dir = dir2;
-                }
-                //check to see if input was cd "" or cd """" or cd """""" and so on
-                if (*dir == '\0') {
-                    if ((dir = getpwuid(getuid())->pw_dir) == NULL){
-                        fprintf(stderr, "Error: Cannot get passwd entry. %s.\n", strerror(errno));
-                        retval = EXIT_FAILURE;
-                        goto EXIT;
-                    }
-                }
+                dir = home_path;
             }
             if (chdir(dir) == -1){
                 fprintf(stderr, "Error: Cannot change directory to '%s'. %s.\n", dir, strerror(errno));
@@ -204,63 +1369,66 @@ int main(){
                 goto EXIT;
                 
             }
-            
+            retval = EXIT_SUCCESS;
             goto EXIT;
         
-        }else if (strncmp(argv[0], "exit", 5) == 0){
+        }else if (strncmp(cmd_argv[0], "exit", 5) == 0){
             
             retval = EXIT_SUCCESS;
             exit = true;
             goto EXIT;
         
+        }else if (strcmp(cmd_argv[0], "hash") == 0){
+
+            retval = hash_builtin(cmd_argc, cmd_argv);
+            goto EXIT;
+
+        }else if (strcmp(cmd_argv[0], "parallel") == 0){
+
+            signal_val = 1;
+            retval = parallel_builtin(&pl.cmds[0], reader.fd != STDIN_FILENO);
+            goto EXIT;
+
+        }else if (strcmp(cmd_argv[0], "jobs") == 0){
+
+            retval = jobs_builtin();
+            goto EXIT;
+
+        }else if (strcmp(cmd_argv[0], "wait") == 0 ||
+                  strcmp(cmd_argv[0], "fg") == 0){
+
+            // A SIGINT while waiting stops the wait rather than the shell.
+            signal_val = 1;
+            int status = cmd_argv[0][0] == 'w' ?
+                         wait_builtin(cmd_argc, cmd_argv) :
+                         fg_builtin(cmd_argc, cmd_argv, interactive);
+            retval = status == EXIT_SUCCESS ? EXIT_SUCCESS : EXIT_FAILURE;
+            goto EXIT;
+
         }else{
             
-            pid_t pid = fork();
-            if (pid < 0){
-                fprintf(stderr, "Error: fork() failed. %s.\n", strerror(errno));
-                    retval = EXIT_FAILURE;
-                    goto EXIT;
-            
-            }else if (pid == 0){
-                if (execvp(argv[0], argv) < 0){
-                    fprintf(stderr, "Error: exec() failed. %s.\n", strerror(errno));
-                    _exit(0);
-                    goto EXIT;
-                }
-            
-            }else{
-                signal_val = 1;
-                int status;
-                pid_t wpid = waitpid(pid, &status, 0);
-                if (wpid == -1){
-                    fprintf(stderr, "Error: wait() failed. %s.\n", strerror(errno));
-                    retval = EXIT_FAILURE;
-                    goto EXIT;
-                }
-                if (!WIFEXITED(status) || (WEXITSTATUS(status) == EXIT_FAILURE)){
-                    retval = EXIT_FAILURE;
-                    goto EXIT;
-                }
-            
-            }
+            signal_val = 1;
+            int status = run_pipeline(&pl, buf);
+            retval = status == -1 ? EXIT_FAILURE : status;
         
         }
             
         EXIT:
             signal_val = 0;
-            if (argv != NULL){
-                for (int i = 0; i <= sizeof(argv); ++i){ 
-                    free(argv[i]);
-                }
-                free(argv);
-
-            }
             if(exit){
                 break;
             }
     
     }
 
+    arena_free(&parse_arena);
+    while (num_jobs > 0){
+        remove_job(0);
+    }
+    free(jobs);
+    close_input(&reader);
+    hash_clear();
+    free(hashed_path_var);
     return retval;
 
 }
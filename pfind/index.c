@@ -0,0 +1,518 @@
+/*******************************************************************************
+ * Name        : index.c
+ * Author      : Marjan Chowdhury
+ * Description : Builds, refreshes and queries pfind's snapshot index.
+ ******************************************************************************/
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "index.h"
+
+#define ALIGN8(n) (((n) + 7) & ~(size_t)7)
+
+typedef struct buffer {
+    char *data;
+    size_t len;
+    size_t cap;
+} buffer;
+
+typedef struct build_stats {
+    uint64_t dirs;
+    uint64_t entries;
+    uint64_t rescanned;
+} build_stats;
+
+/* An old subdirectory block, looked up by name when its parent changed. */
+typedef struct old_subdir {
+    const char *name;
+    const index_dir *dir;
+} old_subdir;
+
+/* Static (private to this file) function prototypes. */
+static size_t buffer_reserve(buffer *buf, size_t n);
+static const index_entry *next_entry(const char **p, const char **name,
+                                     const index_dir **subdir);
+static bool validate_dir(const char *p, const char *end, int depth);
+static const index_dir *map_index(const char *index_path, char **map,
+                                  size_t *map_len, const char **root);
+static void append_entry(buffer *out, const char *name, size_t name_len,
+                         const struct stat *b);
+static void scan_dir(buffer *out, char *path, size_t path_len,
+                     const struct stat *st, const index_dir *old,
+                     build_stats *stats);
+static uint32_t reuse_dir(buffer *out, char *path, size_t path_len,
+                          const index_dir *old, build_stats *stats);
+static uint32_t rescan_dir(buffer *out, char *path, size_t path_len,
+                           const index_dir *old, build_stats *stats,
+                           bool *failed);
+static void query_dir(const index_dir *dir, char *path, size_t path_len,
+                      bool inside, const char *under, const predicate *pred,
+                      match_fn match, void *arg);
+
+/**
+ * Appends n zeroed bytes, rounded up to a multiple of 8, to buf and returns
+ * their offset. Offsets stay valid when the buffer is reallocated.
+ */
+static size_t buffer_reserve(buffer *buf, size_t n){
+    n = ALIGN8(n);
+    if (buf->len + n > buf->cap){
+        size_t cap = buf->cap == 0 ? 65536 : buf->cap;
+        while (cap < buf->len + n){
+            cap *= 2;
+        }
+        char *data = realloc(buf->data, cap);
+        if (data == NULL){
+            fprintf(stderr, "Error: realloc() failed. %s.\n", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        buf->data = data;
+        buf->cap = cap;
+    }
+    size_t offset = buf->len;
+    memset(buf->data + offset, 0, n);
+    buf->len += n;
+    return offset;
+}
+
+/**
+ * Returns the entry at *p and advances *p past it, including the subdirectory
+ * block that follows a directory entry. The index must have been validated.
+ */
+static const index_entry *next_entry(const char **p, const char **name,
+                                     const index_dir **subdir){
+    const index_entry *entry = (const index_entry *)*p;
+    *name = *p + sizeof(index_entry);
+    *p = *name + ALIGN8(entry->name_len + 1);
+    *subdir = NULL;
+    if (S_ISDIR(entry->mode)){
+        *subdir = (const index_dir *)*p;
+        *p += (*subdir)->size;
+    }
+    return entry;
+}
+
+/**
+ * Checks that the directory block at p, and everything below it, fits inside
+ * the mapping, so the rest of this file can walk the index without bounds
+ * checks.
+ */
+static bool validate_dir(const char *p, const char *end, int depth){
+    if (depth > PATH_MAX / 2 || (size_t)(end - p) < sizeof(index_dir)){
+        return false;
+    }
+    const index_dir *dir = (const index_dir *)p;
+    if (dir->size < sizeof(index_dir) || dir->size > (size_t)(end - p) ||
+        dir->size % 8 != 0){
+        return false;
+    }
+    end = p + dir->size;
+    p += sizeof(index_dir);
+    for (uint32_t i = 0; i < dir->num_entries; i++){
+        if ((size_t)(end - p) < sizeof(index_entry)){
+            return false;
+        }
+        const index_entry *entry = (const index_entry *)p;
+        p += sizeof(index_entry);
+        size_t name_size = ALIGN8(entry->name_len + 1);
+        if ((size_t)(end - p) < name_size || p[entry->name_len] != '\0'){
+            return false;
+        }
+        p += name_size;
+        if (S_ISDIR(entry->mode)){
+            if (!validate_dir(p, end, depth + 1)){
+                return false;
+            }
+            p += ((const index_dir *)p)->size;
+        }
+    }
+    return p == end;
+}
+
+/**
+ * Maps an index file read-only and validates it. On success, returns its root
+ * directory block and sets *root to the indexed path. Returns NULL, with errno
+ * set, if the file cannot be mapped, or with errno 0 if it is not a valid
+ * index.
+ */
+static const index_dir *map_index(const char *index_path, char **map,
+                                  size_t *map_len, const char **root){
+    int fd = open(index_path, O_RDONLY);
+    if (fd < 0){
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0){
+        close(fd);
+        return NULL;
+    }
+    errno = 0;
+    if ((size_t)st.st_size < sizeof(index_header)){
+        close(fd);
+        return NULL;
+    }
+    *map_len = st.st_size;
+    *map = mmap(NULL, *map_len, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (*map == MAP_FAILED){
+        return NULL;
+    }
+
+    const index_header *header = (const index_header *)*map;
+    const char *end = *map + *map_len;
+    const char *p = *map + sizeof(index_header);
+    size_t root_size = ALIGN8((size_t)header->root_len + 1);
+    errno = 0;
+    if (memcmp(header->magic, INDEX_MAGIC, sizeof(header->magic)) != 0 ||
+        (size_t)(end - p) < root_size || p[header->root_len] != '\0' ||
+        !validate_dir(p + root_size, end, 0) ||
+        ((const index_dir *)(p + root_size))->size !=
+            (size_t)(end - p) - root_size){
+        munmap(*map, *map_len);
+        return NULL;
+    }
+    *root = p;
+    return (const index_dir *)(p + root_size);
+}
+
+static void append_entry(buffer *out, const char *name, size_t name_len,
+                         const struct stat *b){
+    size_t offset = buffer_reserve(out, sizeof(index_entry) + name_len + 1);
+    index_entry *entry = (index_entry *)(out->data + offset);
+    entry->size = b->st_size;
+    entry->mtime = b->st_mtime;
+    entry->mode = b->st_mode;
+    entry->uid = b->st_uid;
+    entry->name_len = name_len;
+    memcpy(out->data + offset + sizeof(index_entry), name, name_len);
+}
+
+/**
+ * Writes the block for the directory at path. If the directory's mtime
+ * matches the old snapshot, its entry list cannot have changed, so the old
+ * entries are copied without a readdir or any lstat of plain files. Only its
+ * subdirectories are stat'ed, to find the ones that did change.
+ */
+static void scan_dir(buffer *out, char *path, size_t path_len,
+                     const struct stat *st, const index_dir *old,
+                     build_stats *stats){
+    size_t offset = buffer_reserve(out, sizeof(index_dir));
+    uint32_t count;
+    bool failed = false;
+    if (old != NULL && old->mtime_sec == st->st_mtim.tv_sec &&
+        old->mtime_nsec == st->st_mtim.tv_nsec){
+        count = reuse_dir(out, path, path_len, old, stats);
+    }else{
+        count = rescan_dir(out, path, path_len, old, stats, &failed);
+        stats->rescanned++;
+    }
+    index_dir *dir = (index_dir *)(out->data + offset);
+    dir->size = out->len - offset;
+    // A directory that could not be read is always rescanned next time.
+    dir->mtime_sec = failed ? -1 : st->st_mtim.tv_sec;
+    dir->mtime_nsec = failed ? -1 : st->st_mtim.tv_nsec;
+    dir->num_entries = count;
+    stats->dirs++;
+}
+
+static uint32_t reuse_dir(buffer *out, char *path, size_t path_len,
+                          const index_dir *old, build_stats *stats){
+    uint32_t count = 0;
+    const char *p = (const char *)(old + 1);
+    path[path_len++] = '/';
+    for (uint32_t i = 0; i < old->num_entries; i++){
+        const char *name;
+        const index_dir *subdir;
+        const index_entry *entry = next_entry(&p, &name, &subdir);
+        if (subdir == NULL){
+            size_t offset = buffer_reserve(out, sizeof(index_entry) +
+                                                entry->name_len + 1);
+            memcpy(out->data + offset, entry,
+                   sizeof(index_entry) + entry->name_len);
+            count++;
+            continue;
+        }
+        if (path_len + entry->name_len >= PATH_MAX){
+            continue;
+        }
+        memcpy(path + path_len, name, entry->name_len + 1);
+        struct stat b;
+        if (lstat(path, &b) < 0){
+            fprintf(stderr, "Error: Cannot stat '%s'. %s.\n", path,
+                    strerror(errno));
+            continue;
+        }
+        append_entry(out, name, entry->name_len, &b);
+        count++;
+        if (S_ISDIR(b.st_mode)){
+            scan_dir(out, path, path_len + entry->name_len, &b, subdir, stats);
+        }
+    }
+    path[--path_len] = '\0';
+    stats->entries += count;
+    return count;
+}
+
+static int old_subdir_cmp(const void *a, const void *b){
+    return strcmp(((const old_subdir *)a)->name, ((const old_subdir *)b)->name);
+}
+
+static uint32_t rescan_dir(buffer *out, char *path, size_t path_len,
+                           const index_dir *old, build_stats *stats,
+                           bool *failed){
+    DIR *dir;
+    if ((dir = opendir(path)) == NULL){
+        fprintf(stderr,"Error: Cannot open directory '%s'. %s\n",path,strerror(errno));
+        *failed = true;
+        return 0;
+    }
+
+    // Collect the old subdirectory blocks so unchanged subtrees below a
+    // changed directory can still be reused.
+    old_subdir *subdirs = NULL;
+    size_t num_subdirs = 0;
+    if (old != NULL && old->num_entries > 0){
+        if ((subdirs = malloc(old->num_entries * sizeof(old_subdir))) == NULL){
+            fprintf(stderr, "Error: malloc() failed. %s.\n", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        const char *p = (const char *)(old + 1);
+        for (uint32_t i = 0; i < old->num_entries; i++){
+            const char *name;
+            const index_dir *subdir;
+            next_entry(&p, &name, &subdir);
+            if (subdir != NULL){
+                subdirs[num_subdirs].name = name;
+                subdirs[num_subdirs++].dir = subdir;
+            }
+        }
+        qsort(subdirs, num_subdirs, sizeof(old_subdir), old_subdir_cmp);
+    }
+
+    uint32_t count = 0;
+    struct dirent *de;
+    path[path_len++] = '/';
+    while ((de = readdir(dir)) != NULL){
+        if (strcmp(de->d_name, ".") == 0 ||
+            strcmp(de->d_name, "..") == 0){
+            continue;
+        }
+        size_t name_len = strlen(de->d_name);
+        if (path_len + name_len >= PATH_MAX){
+            fprintf(stderr, "Error: Path '%s%s' is too long.\n", path,
+                    de->d_name);
+            continue;
+        }
+        memcpy(path + path_len, de->d_name, name_len + 1);
+        struct stat b;
+        if (lstat(path, &b) < 0){
+            fprintf(stderr, "Error: Cannot stat '%s'. %s.\n", path,
+                    strerror(errno));
+            continue;
+        }
+        append_entry(out, de->d_name, name_len, &b);
+        count++;
+        if (S_ISDIR(b.st_mode)){
+            old_subdir key = {de->d_name, NULL};
+            old_subdir *found = num_subdirs == 0 ? NULL :
+                bsearch(&key, subdirs, num_subdirs, sizeof(old_subdir),
+                        old_subdir_cmp);
+            scan_dir(out, path, path_len + name_len, &b,
+                     found == NULL ? NULL : found->dir, stats);
+        }
+    }
+    path[--path_len] = '\0';
+    closedir(dir);
+    free(subdirs);
+    stats->entries += count;
+    return count;
+}
+
+/**
+ * Writes a snapshot of directory to index_path. If index_path already holds a
+ * snapshot of the same directory, only directories whose mtime changed are
+ * read again. Attributes of files in unchanged directories are carried over
+ * from the old snapshot; remove the index to force a full rescan.
+ */
+int index_build(const char *directory, const char *index_path){
+    char *map = NULL;
+    size_t map_len = 0;
+    const char *old_root_path = NULL;
+    const index_dir *old_root = map_index(index_path, &map, &map_len,
+                                          &old_root_path);
+    if (old_root == NULL && errno != ENOENT){
+        fprintf(stderr, "Warning: Ignoring existing index '%s'.%s%s\n",
+                index_path, errno != 0 ? " " : "",
+                errno != 0 ? strerror(errno) : "");
+    }else if (old_root != NULL && strcmp(old_root_path, directory) != 0){
+        fprintf(stderr, "Warning: Index '%s' was built for '%s', rebuilding.\n",
+                index_path, old_root_path);
+        old_root = NULL;
+    }
+
+    struct stat st;
+    if (lstat(directory, &st) < 0){
+        fprintf(stderr, "Error: Cannot stat '%s'. %s.\n", directory,
+                strerror(errno));
+        if (map != NULL && old_root_path != NULL){
+            munmap(map, map_len);
+        }
+        return EXIT_FAILURE;
+    }
+
+    buffer out = {NULL, 0, 0};
+    size_t root_len = strlen(directory);
+    buffer_reserve(&out, sizeof(index_header));
+    size_t root_offset = buffer_reserve(&out, root_len + 1);
+    memcpy(out.data + root_offset, directory, root_len);
+
+    char path[PATH_MAX];
+    memcpy(path, directory, root_len + 1);
+    // The root is joined with '/' below, so "/" itself must not add another.
+    size_t path_len = strcmp(directory, "/") == 0 ? 0 : root_len;
+    build_stats stats = {0, 0, 0};
+    scan_dir(&out, path, path_len, &st, old_root, &stats);
+    if (old_root_path != NULL){
+        munmap(map, map_len);
+    }
+
+    index_header *header = (index_header *)out.data;
+    memcpy(header->magic, INDEX_MAGIC, sizeof(header->magic));
+    header->num_dirs = stats.dirs;
+    header->num_entries = stats.entries;
+    header->root_len = root_len;
+
+    // Write to a temporary file and rename it over the old index, so that
+    // queries running at the same time always see a complete snapshot.
+    char tmp_path[PATH_MAX];
+    if (snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", index_path) >=
+            (int)sizeof(tmp_path)){
+        fprintf(stderr, "Error: Index path '%s' is too long.\n", index_path);
+        free(out.data);
+        return EXIT_FAILURE;
+    }
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0){
+        fprintf(stderr, "Error: Cannot open '%s'. %s.\n", tmp_path,
+                strerror(errno));
+        free(out.data);
+        return EXIT_FAILURE;
+    }
+    size_t written = 0;
+    while (written < out.len){
+        ssize_t n = write(fd, out.data + written, out.len - written);
+        if (n < 0){
+            if (errno == EINTR){
+                continue;
+            }
+            fprintf(stderr, "Error: write() failed. %s.\n", strerror(errno));
+            close(fd);
+            unlink(tmp_path);
+            free(out.data);
+            return EXIT_FAILURE;
+        }
+        written += n;
+    }
+    free(out.data);
+    if (close(fd) < 0 || rename(tmp_path, index_path) < 0){
+        fprintf(stderr, "Error: Cannot write index '%s'. %s.\n", index_path,
+                strerror(errno));
+        unlink(tmp_path);
+        return EXIT_FAILURE;
+    }
+
+    printf("Indexed %llu entries in %llu directories, %llu rescanned.\n",
+           (unsigned long long)stats.entries, (unsigned long long)stats.dirs,
+           (unsigned long long)stats.rescanned);
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Calls match for the entries below dir that pass pred. inside is false while
+ * walking down towards under, the only directory whose contents are wanted.
+ */
+static void query_dir(const index_dir *dir, char *path, size_t path_len,
+                      bool inside, const char *under, const predicate *pred,
+                      match_fn match, void *arg){
+    const char *p = (const char *)(dir + 1);
+    path[path_len++] = '/';
+    for (uint32_t i = 0; i < dir->num_entries; i++){
+        const char *name;
+        const index_dir *subdir;
+        const index_entry *entry = next_entry(&p, &name, &subdir);
+        if (path_len + entry->name_len >= PATH_MAX){
+            continue;
+        }
+        memcpy(path + path_len, name, entry->name_len + 1);
+        size_t child_len = path_len + entry->name_len;
+
+        if (inside){
+            struct stat b;
+            memset(&b, 0, sizeof(struct stat));
+            b.st_mode = entry->mode;
+            b.st_uid = entry->uid;
+            b.st_size = entry->size;
+            b.st_mtime = entry->mtime;
+            if (match_dirent(pred, name, IFTODT(entry->mode)) &&
+                match_stat(pred, &b)){
+                match(path, child_len, arg);
+            }
+            if (subdir != NULL){
+                query_dir(subdir, path, child_len, true, under, pred, match,
+                          arg);
+            }
+        }else if (subdir != NULL && strncmp(under, path, child_len) == 0 &&
+                  (under[child_len] == '/' || under[child_len] == '\0')){
+            query_dir(subdir, path, child_len, under[child_len] == '\0',
+                      under, pred, match, arg);
+        }
+    }
+}
+
+/**
+ * Calls match for the entries in the snapshot at index_path that pass pred,
+ * in the same order navigate() would. If under is not NULL, only entries
+ * below that directory are printed.
+ */
+int index_query(const char *index_path, const char *under,
+                const predicate *pred, match_fn match, void *arg){
+    char *map;
+    size_t map_len;
+    const char *root_path;
+    const index_dir *root = map_index(index_path, &map, &map_len, &root_path);
+    if (root == NULL){
+        if (errno != 0){
+            fprintf(stderr, "Error: Cannot open index '%s'. %s.\n",
+                    index_path, strerror(errno));
+        }else{
+            fprintf(stderr, "Error: '%s' is not a valid index.\n", index_path);
+        }
+        return EXIT_FAILURE;
+    }
+
+    size_t root_len = strlen(root_path);
+    if (strcmp(root_path, "/") == 0){
+        root_len = 0;
+    }
+    if (under != NULL && (strncmp(under, root_path, root_len) != 0 ||
+                          (under[root_len] != '/' && under[root_len] != '\0'))){
+        fprintf(stderr, "Error: '%s' is not covered by index '%s'.\n", under,
+                index_path);
+        munmap(map, map_len);
+        return EXIT_FAILURE;
+    }
+
+    char path[PATH_MAX];
+    memcpy(path, root_path, root_len);
+    path[root_len] = '\0';
+    bool inside = under == NULL || under[root_len] == '\0' ||
+                  strcmp(under + root_len, "/") == 0;
+    query_dir(root, path, root_len, inside, under, pred, match, arg);
+    munmap(map, map_len);
+    return EXIT_SUCCESS;
+}
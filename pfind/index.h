@@ -0,0 +1,57 @@
+/*******************************************************************************
+ * Name        : index.h
+ * Author      : Marjan Chowdhury
+ * Description : Snapshot index for repeated pfind queries.
+ ******************************************************************************/
+#ifndef INDEX_H_
+#define INDEX_H_
+
+#include <stdint.h>
+#include "predicate.h"
+#include "search.h"
+
+#define INDEX_MAGIC "PFINDIX1"
+
+/*
+ * On-disk layout, in host byte order, every record aligned to 8 bytes:
+ *
+ *   index_header, root path (NUL terminated), root index_dir
+ *
+ * An index_dir is followed by its num_entries index_entry records, in the
+ * order readdir() returned them. Each index_entry is followed by its name,
+ * and if the entry is a directory, by that directory's own index_dir. Reading
+ * the file front to back therefore visits entries in the same order as
+ * navigate() prints them.
+ */
+typedef struct index_header {
+    char magic[8];
+    uint64_t num_dirs;
+    uint64_t num_entries;
+    uint32_t root_len;
+    uint32_t reserved;
+} index_header;
+
+typedef struct index_dir {
+    uint64_t size;          // bytes up to the end of the last descendant
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint32_t num_entries;
+    uint32_t reserved;
+} index_dir;
+
+typedef struct index_entry {
+    int64_t size;
+    int64_t mtime;
+    uint32_t mode;
+    uint32_t uid;
+    uint16_t name_len;
+    uint16_t reserved[3];
+} index_entry;
+
+/* Function prototypes */
+
+int index_build(const char *directory, const char *index_path);
+int index_query(const char *index_path, const char *under,
+                const predicate *pred, match_fn match, void *arg);
+
+#endif
@@ -0,0 +1,230 @@
+/*******************************************************************************
+ * Name        : predicate.c
+ * Author      : Marjan Chowdhury
+ * Description : Parsing and evaluation of pfind's search tests.
+ ******************************************************************************/
+#include <dirent.h>
+#include <errno.h>
+#include <fnmatch.h>
+#include <pwd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "predicate.h"
+
+static const int perms[] = {S_IRUSR, S_IWUSR, S_IXUSR,
+                            S_IRGRP, S_IWGRP, S_IXGRP,
+                            S_IROTH, S_IWOTH, S_IXOTH};
+
+/* Static (private to this file) function prototypes. */
+static const char *parse_cmp(const char *arg, enum cmp_t *cmp,
+                             long long *value);
+static bool match_cmp(enum cmp_t cmp, long long actual, long long wanted);
+
+/**
+ * Resets pred so that it matches everything.
+ */
+void predicate_init(predicate *pred){
+    memset(pred, 0, sizeof(predicate));
+    pred->type = DT_UNKNOWN;
+}
+
+/**
+ * Called once all options have been parsed. Works out whether entries need
+ * to be stat'ed at all and fixes the reference time for -mtime.
+ */
+void predicate_finish(predicate *pred){
+    pred->needs_stat = pred->check_perms || pred->check_user ||
+                       pred->size_cmp != CMP_NONE ||
+                       pred->mtime_cmp != CMP_NONE;
+    pred->now = time(NULL);
+}
+
+bool verify_perms(const char *permissions){
+    bool result = true;
+    if (strlen(permissions) != 9){
+        result = false;
+    }
+    for (int i = 0; i <= 8 && result; i++){
+        if (i % 3 == 0){
+            if (*(permissions + i) != 'r' && *(permissions + i) != '-'){
+                result = false;
+            }
+        }else if (i % 3 == 1){
+            if (*(permissions + i) != 'w' && *(permissions + i) != '-'){
+                result = false;
+            }
+        }else{
+            if (*(permissions + i) != 'x' && *(permissions + i) != '-'){
+                result = false;
+            }
+        }
+    }
+    return result;
+}
+
+/**
+ * Converts a permission string already checked by verify_perms() into mode
+ * bits, so entries can be compared without building a string for each one.
+ */
+mode_t perms_to_mode(const char *permissions){
+    mode_t mode = 0;
+    for (int i = 0; i < 9; i++){
+        if (permissions[i] != '-'){
+            mode |= perms[i];
+        }
+    }
+    return mode;
+}
+
+/**
+ * Parses a find(1) style numeric argument: N, +N (more than N) or -N (less
+ * than N). Returns a pointer to the first character after the digits, or NULL
+ * if there are no digits.
+ */
+static const char *parse_cmp(const char *arg, enum cmp_t *cmp,
+                             long long *value){
+    *cmp = CMP_EQUAL;
+    if (*arg == '+'){
+        *cmp = CMP_GREATER;
+        arg++;
+    }else if (*arg == '-'){
+        *cmp = CMP_LESS;
+        arg++;
+    }
+    char *end;
+    errno = 0;
+    *value = strtoll(arg, &end, 10);
+    if (end == arg || *arg == '-' || *arg == '+' || errno != 0){
+        return NULL;
+    }
+    return end;
+}
+
+bool parse_size(const char *arg, predicate *pred){
+    const char *end = parse_cmp(arg, &pred->size_cmp, &pred->size);
+    if (end == NULL){
+        return false;
+    }
+    // As in find, a bare N counts 512-byte blocks and c counts bytes.
+    switch (*end){
+    case '\0':
+    case 'b':
+        pred->size_unit = 512;
+        break;
+    case 'c':
+        pred->size_unit = 1;
+        break;
+    case 'k':
+        pred->size_unit = 1024LL;
+        break;
+    case 'M':
+        pred->size_unit = 1024LL * 1024;
+        break;
+    case 'G':
+        pred->size_unit = 1024LL * 1024 * 1024;
+        break;
+    default:
+        return false;
+    }
+    return *end == '\0' || *(end + 1) == '\0';
+}
+
+bool parse_mtime(const char *arg, predicate *pred){
+    const char *end = parse_cmp(arg, &pred->mtime_cmp, &pred->mtime);
+    return end != NULL && *end == '\0';
+}
+
+bool parse_user(const char *arg, predicate *pred){
+    struct passwd *pw = getpwnam(arg);
+    if (pw != NULL){
+        pred->uid = pw->pw_uid;
+        pred->check_user = true;
+        return true;
+    }
+    char *end;
+    errno = 0;
+    long uid = strtol(arg, &end, 10);
+    if (end == arg || *end != '\0' || errno != 0 || uid < 0){
+        return false;
+    }
+    pred->uid = (uid_t)uid;
+    pred->check_user = true;
+    return true;
+}
+
+bool parse_type(const char *arg, predicate *pred){
+    if (strlen(arg) != 1){
+        return false;
+    }
+    switch (*arg){
+    case 'f': pred->type = DT_REG; break;
+    case 'd': pred->type = DT_DIR; break;
+    case 'l': pred->type = DT_LNK; break;
+    case 'p': pred->type = DT_FIFO; break;
+    case 's': pred->type = DT_SOCK; break;
+    case 'c': pred->type = DT_CHR; break;
+    case 'b': pred->type = DT_BLK; break;
+    default: return false;
+    }
+    return true;
+}
+
+static bool match_cmp(enum cmp_t cmp, long long actual, long long wanted){
+    switch (cmp){
+    case CMP_LESS:
+        return actual < wanted;
+    case CMP_GREATER:
+        return actual > wanted;
+    case CMP_EQUAL:
+        return actual == wanted;
+    default:
+        return true;
+    }
+}
+
+/**
+ * Runs the tests that only need the directory entry. d_type may be
+ * DT_UNKNOWN on some filesystems, in which case the type test is deferred
+ * until after the lstat.
+ */
+bool match_dirent(const predicate *pred, const char *name,
+                  unsigned char d_type){
+    if (pred->name != NULL && fnmatch(pred->name, name, 0) != 0){
+        return false;
+    }
+    if (pred->type != DT_UNKNOWN && d_type != DT_UNKNOWN &&
+        d_type != pred->type){
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Runs the tests that need the result of lstat, roughly cheapest first.
+ */
+bool match_stat(const predicate *pred, const struct stat *b){
+    if (pred->type != DT_UNKNOWN && IFTODT(b->st_mode) != pred->type){
+        return false;
+    }
+    if (pred->check_perms && (b->st_mode & 0777) != pred->perms){
+        return false;
+    }
+    if (pred->check_user && b->st_uid != pred->uid){
+        return false;
+    }
+    if (pred->size_cmp != CMP_NONE){
+        // Like find, sizes are rounded up to the next whole unit.
+        long long units = (b->st_size + pred->size_unit - 1) / pred->size_unit;
+        if (!match_cmp(pred->size_cmp, units, pred->size)){
+            return false;
+        }
+    }
+    if (pred->mtime_cmp != CMP_NONE){
+        long long days = (pred->now - b->st_mtime) / SECONDS_PER_DAY;
+        if (!match_cmp(pred->mtime_cmp, days, pred->mtime)){
+            return false;
+        }
+    }
+    return true;
+}
@@ -0,0 +1,55 @@
+/*******************************************************************************
+ * Name        : predicate.h
+ * Author      : Marjan Chowdhury
+ * Description : Compiled search tests shared by pfind's walk and index.
+ ******************************************************************************/
+#ifndef PREDICATE_H_
+#define PREDICATE_H_
+
+#include <stdbool.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#define SECONDS_PER_DAY 86400
+
+enum cmp_t { CMP_NONE, CMP_LESS, CMP_EQUAL, CMP_GREATER };
+
+/**
+ * A compiled search expression. Every test that is set must pass for an entry
+ * to be printed. The tests are split by cost: name and type only need the
+ * dirent, everything else needs an lstat, which is only issued once all of
+ * the cheap tests have passed.
+ */
+typedef struct predicate {
+    const char *name;       // -name glob, matched against d_name
+    int type;               // -type as a DT_* value, or DT_UNKNOWN if unset
+    bool check_perms;
+    mode_t perms;           // -p, permission bits only
+    bool check_user;
+    uid_t uid;              // -user
+    enum cmp_t size_cmp;
+    long long size;         // -size, in units of size_unit
+    long long size_unit;
+    enum cmp_t mtime_cmp;
+    long long mtime;        // -mtime, in days
+    time_t now;             // reference time for -mtime
+    bool needs_stat;
+} predicate;
+
+/* Function prototypes */
+
+void predicate_init(predicate *pred);
+void predicate_finish(predicate *pred);
+
+bool verify_perms(const char *permissions);
+mode_t perms_to_mode(const char *permissions);
+bool parse_size(const char *arg, predicate *pred);
+bool parse_mtime(const char *arg, predicate *pred);
+bool parse_user(const char *arg, predicate *pred);
+bool parse_type(const char *arg, predicate *pred);
+
+bool match_dirent(const predicate *pred, const char *name,
+                  unsigned char d_type);
+bool match_stat(const predicate *pred, const struct stat *b);
+
+#endif
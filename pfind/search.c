@@ -0,0 +1,373 @@
+/*******************************************************************************
+ * Name        : search.c
+ * Author      : Marjan Chowdhury
+ * Description : Command line parsing and directory walk shared by pfind and
+ *               spfind.
+ ******************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <errno.h>
+#include <dirent.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include "search.h"
+
+void display_usage(const char *prog){
+    printf("Usage: %s -d <directory> [-p <permission string>] "
+           "[-size [+-]N[bckMG]]\n"
+           "               [-mtime [+-]N] [-name <glob>] [-user <name|uid>] "
+           "[-type <fdlpscb>]\n"
+           "               [-i <index file>] [-h]\n"
+           "       %s -d <directory> -b <index file>\n", prog, prog);
+}
+
+/**
+ * Walks directory recursively and calls match with the full path of every
+ * entry that passes pred, in the order readdir() returns them.
+ */
+int navigate(char *directory, const predicate *pred, match_fn match,
+             void *arg){
+    char copy[PATH_MAX];
+    struct dirent *de;
+    DIR *dir;
+    if ((dir = opendir(directory)) == NULL){
+        fprintf(stderr,"Error: Cannot open directory '%s'. %s\n",directory,strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    // The directory prefix is the same for every entry, so copy it once.
+    size_t prefix_len = strlen(directory);
+    memcpy(copy, directory, prefix_len);
+    if (prefix_len == 0 || copy[prefix_len - 1] != '/'){
+        copy[prefix_len++] = '/';
+    }
+
+    while ((de = readdir(dir)) != NULL){
+        if (strcmp(de->d_name, ".") == 0 ||
+            strcmp(de->d_name, "..") == 0){
+            continue;
+        }
+        size_t name_len = strlen(de->d_name);
+        if (prefix_len + name_len >= PATH_MAX){
+            fprintf(stderr, "Error: Path '%s/%s' is too long.\n", directory,
+                    de->d_name);
+            continue;
+        }
+        memcpy(copy + prefix_len, de->d_name, name_len + 1);
+
+        bool matched = match_dirent(pred, de->d_name, de->d_type);
+        bool is_dir = de->d_type == DT_DIR;
+        if ((matched && pred->needs_stat) || de->d_type == DT_UNKNOWN){
+            struct stat b;
+            if (lstat(copy, &b) < 0){
+                fprintf(stderr, "Error: Cannot stat '%s'. %s.\n", copy,
+                        strerror(errno));
+                continue;
+            }
+            is_dir = S_ISDIR(b.st_mode);
+            matched = matched && match_stat(pred, &b);
+        }
+
+        if (matched){
+            match(copy, prefix_len + name_len, arg);
+        }
+
+        if (is_dir){
+            navigate(copy, pred, match, arg);
+        }
+    }
+    closedir(dir);
+    return EXIT_SUCCESS;
+}
+
+/* An entry of one directory, as seen by navigate_sorted(). */
+typedef struct sorted_entry {
+    const char *name;
+    size_t offset;          // of name in the directory's name buffer
+    size_t len;
+    bool subtree;           // stands for everything below the entry
+} sorted_entry;
+
+/**
+ * Orders entries as their full paths would sort in byte order. A subtree
+ * entry sorts as "name/", since every path below it starts with that, and no
+ * sibling name can fall between two of those paths because names cannot
+ * contain '/'.
+ */
+static int sorted_entry_cmp(const void *a, const void *b){
+    const sorted_entry *x = (const sorted_entry *)a;
+    const sorted_entry *y = (const sorted_entry *)b;
+    size_t len = x->len < y->len ? x->len : y->len;
+    int result = memcmp(x->name, y->name, len);
+    if (result != 0){
+        return result;
+    }
+    int x_next = x->len > len ? (unsigned char)x->name[len] :
+                 x->subtree ? '/' : -1;
+    int y_next = y->len > len ? (unsigned char)y->name[len] :
+                 y->subtree ? '/' : -1;
+    return x_next - y_next;
+}
+
+/**
+ * Like navigate(), but calls match in sorted order. Only the entries of the
+ * directories on the current path are held in memory, so the first results
+ * are reported as soon as the first directory chain has been read, rather
+ * than after the whole tree.
+ */
+int navigate_sorted(char *directory, const predicate *pred, match_fn match,
+                    void *arg){
+    char copy[PATH_MAX];
+    struct dirent *de;
+    DIR *dir;
+    if ((dir = opendir(directory)) == NULL){
+        fprintf(stderr,"Error: Cannot open directory '%s'. %s\n",directory,strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    size_t prefix_len = strlen(directory);
+    memcpy(copy, directory, prefix_len);
+    if (prefix_len == 0 || copy[prefix_len - 1] != '/'){
+        copy[prefix_len++] = '/';
+    }
+
+    char *names = NULL;
+    size_t names_len = 0, names_cap = 0;
+    sorted_entry *entries = NULL;
+    size_t count = 0, cap = 0;
+    while ((de = readdir(dir)) != NULL){
+        if (strcmp(de->d_name, ".") == 0 ||
+            strcmp(de->d_name, "..") == 0){
+            continue;
+        }
+        size_t name_len = strlen(de->d_name);
+        if (prefix_len + name_len >= PATH_MAX){
+            fprintf(stderr, "Error: Path '%s/%s' is too long.\n", directory,
+                    de->d_name);
+            continue;
+        }
+
+        bool matched = match_dirent(pred, de->d_name, de->d_type);
+        bool is_dir = de->d_type == DT_DIR;
+        if ((matched && pred->needs_stat) || de->d_type == DT_UNKNOWN){
+            memcpy(copy + prefix_len, de->d_name, name_len + 1);
+            struct stat b;
+            if (lstat(copy, &b) < 0){
+                fprintf(stderr, "Error: Cannot stat '%s'. %s.\n", copy,
+                        strerror(errno));
+                continue;
+            }
+            is_dir = S_ISDIR(b.st_mode);
+            matched = matched && match_stat(pred, &b);
+        }
+        if (!matched && !is_dir){
+            continue;
+        }
+
+        if (names_len + name_len + 1 > names_cap){
+            names_cap = names_cap == 0 ? 4096 : names_cap * 2;
+            while (names_cap < names_len + name_len + 1){
+                names_cap *= 2;
+            }
+            if ((names = realloc(names, names_cap)) == NULL){
+                fprintf(stderr, "Error: realloc() failed. %s.\n",
+                        strerror(errno));
+                exit(EXIT_FAILURE);
+            }
+        }
+        if (count + 2 > cap){
+            cap = cap == 0 ? 64 : cap * 2;
+            if ((entries = realloc(entries, cap * sizeof(sorted_entry))) == NULL){
+                fprintf(stderr, "Error: realloc() failed. %s.\n",
+                        strerror(errno));
+                exit(EXIT_FAILURE);
+            }
+        }
+        memcpy(names + names_len, de->d_name, name_len + 1);
+        if (matched){
+            entries[count].offset = names_len;
+            entries[count].len = name_len;
+            entries[count++].subtree = false;
+        }
+        if (is_dir){
+            entries[count].offset = names_len;
+            entries[count].len = name_len;
+            entries[count++].subtree = true;
+        }
+        names_len += name_len + 1;
+    }
+    closedir(dir);
+
+    // The name buffer no longer moves, so the offsets can be resolved.
+    for (size_t i = 0; i < count; i++){
+        entries[i].name = names + entries[i].offset;
+    }
+    qsort(entries, count, sizeof(sorted_entry), sorted_entry_cmp);
+    for (size_t i = 0; i < count; i++){
+        memcpy(copy + prefix_len, entries[i].name, entries[i].len + 1);
+        if (entries[i].subtree){
+            navigate_sorted(copy, pred, match, arg);
+        }else{
+            match(copy, prefix_len + entries[i].len, arg);
+        }
+    }
+    free(names);
+    free(entries);
+    return EXIT_SUCCESS;
+}
+
+
+/**
+ * Parses and validates pfind's command line into opts. Prints the usage or
+ * an error message itself; returns PARSE_HELP after -h and PARSE_ERROR if
+ * the program should exit with a failure.
+ */
+int parse_search_args(int argc, char *argv[], search_opts *opts){
+    if (argc == 1){
+        display_usage(argv[0]);
+        return PARSE_ERROR;
+    }
+
+    static struct option long_options[] = {
+        {"size",  required_argument, NULL, 's'},
+        {"mtime", required_argument, NULL, 'm'},
+        {"name",  required_argument, NULL, 'n'},
+        {"user",  required_argument, NULL, 'u'},
+        {"type",  required_argument, NULL, 't'},
+        {NULL, 0, NULL, 0}
+    };
+
+    predicate *pred = &opts->pred;
+    predicate_init(pred);
+    opts->directory = NULL;
+    opts->build_index = NULL;
+    opts->query_index = NULL;
+
+    bool d_flag = false;
+    bool p_flag = false;
+    bool test_flag = false;
+    char directory[PATH_MAX];
+    char permissions[10];
+    int opt = -1;
+    while ((opt = getopt_long_only(argc, argv, ":d:p:b:i:h", long_options,
+                                   NULL)) != -1){
+        switch (opt){
+        case 'd':
+            if (strlen(optarg) >= PATH_MAX){
+                fprintf(stderr, "Error: Directory name is too long.\n");
+                return PARSE_ERROR;
+            }
+            strcpy(directory, optarg);
+            d_flag = true;
+            break;
+        case 'p':
+            if (!verify_perms(optarg)){
+                fprintf(stderr, "Error: Permission string '%s' is invalid\n", optarg);
+                return PARSE_ERROR;
+            }
+            strcpy(permissions, optarg);
+            p_flag = true;
+            break;
+        case 'b':
+            opts->build_index = optarg;
+            break;
+        case 'i':
+            opts->query_index = optarg;
+            break;
+        case 's':
+            if (!parse_size(optarg, pred)){
+                fprintf(stderr, "Error: Invalid size '%s'.\n", optarg);
+                return PARSE_ERROR;
+            }
+            test_flag = true;
+            break;
+        case 'm':
+            if (!parse_mtime(optarg, pred)){
+                fprintf(stderr, "Error: Invalid mtime '%s'.\n", optarg);
+                return PARSE_ERROR;
+            }
+            test_flag = true;
+            break;
+        case 'n':
+            pred->name = optarg;
+            test_flag = true;
+            break;
+        case 'u':
+            if (!parse_user(optarg, pred)){
+                fprintf(stderr, "Error: Unknown user '%s'.\n", optarg);
+                return PARSE_ERROR;
+            }
+            test_flag = true;
+            break;
+        case 't':
+            if (!parse_type(optarg, pred)){
+                fprintf(stderr, "Error: Invalid type '%s'.\n", optarg);
+                return PARSE_ERROR;
+            }
+            test_flag = true;
+            break;
+        case 'h':
+            display_usage(argv[0]);
+            return PARSE_HELP;
+        case ':':
+            fprintf(stderr, "Error: Option '%s' requires an argument.\n",
+                    argv[optind - 1]);
+            return PARSE_ERROR;
+        case '?':
+            fprintf(stderr, "Error: Unknown option '%s' received.\n",
+                    argv[optind - 1]);
+            return PARSE_ERROR;
+        }
+    }
+
+    if (opts->build_index != NULL && opts->query_index != NULL){
+        fprintf(stderr, "Error: Options -b and -i cannot be used together.\n");
+        return PARSE_ERROR;
+    }
+
+    if(!d_flag && opts->query_index == NULL){
+        fprintf(stderr, "Error: Required argument -d <directory> not found.\n");
+        return PARSE_ERROR;
+    }
+
+    if (opts->build_index != NULL){
+        if (p_flag || test_flag){
+            fprintf(stderr, "Error: Search tests cannot be used with -b.\n");
+            return PARSE_ERROR;
+        }
+    }else if (!p_flag && !test_flag){
+        fprintf(stderr, "Error: Required argument -p <permissions string> not found.\n");
+        return PARSE_ERROR;
+    }
+
+    if (p_flag){
+        pred->check_perms = true;
+        pred->perms = perms_to_mode(permissions);
+    }
+    predicate_finish(pred);
+
+    if (!d_flag){
+        return PARSE_OK;
+    }
+
+    struct stat statbuf;
+    if (stat(directory, &statbuf) < 0){
+        fprintf(stderr, "Error: Cannot stat '%s'. %s.\n", directory,
+                strerror(errno));
+        return PARSE_ERROR;
+    }
+    if (!(S_ISDIR(statbuf.st_mode))){
+        fprintf(stderr, "Error: '%s' is not a directory.\n", directory);
+        return PARSE_ERROR;
+    }
+    if ((opts->directory = realpath(directory, opts->path)) == NULL){
+        fprintf(stderr, "Error: Cannot get full path of file '%s'. %s\n",
+                directory, strerror(errno));
+        return PARSE_ERROR;
+    }
+    return PARSE_OK;
+}
@@ -0,0 +1,36 @@
+/*******************************************************************************
+ * Name        : search.h
+ * Author      : Marjan Chowdhury
+ * Description : Command line parsing and directory walk shared by pfind and
+ *               spfind.
+ ******************************************************************************/
+#ifndef SEARCH_H_
+#define SEARCH_H_
+
+#include <limits.h>
+#include <stddef.h>
+#include "predicate.h"
+
+enum parse_result_t { PARSE_OK, PARSE_HELP, PARSE_ERROR };
+
+/* Called with the full path of every entry that matches. */
+typedef void (*match_fn)(const char *path, size_t len, void *arg);
+
+typedef struct search_opts {
+    predicate pred;
+    char *directory;        // real path of -d, or NULL if only -i was given
+    char *build_index;      // -b
+    char *query_index;      // -i
+    char path[PATH_MAX];
+} search_opts;
+
+/* Function prototypes */
+
+void display_usage(const char *prog);
+int parse_search_args(int argc, char *argv[], search_opts *opts);
+int navigate(char *directory, const predicate *pred, match_fn match,
+             void *arg);
+int navigate_sorted(char *directory, const predicate *pred, match_fn match,
+                    void *arg);
+
+#endif
@@ -3,133 +3,375 @@
  * Author      : Marjan Chowdhury
  * Description : Sorted Permission Find Implementation
  ******************************************************************************/
-#include <ctype.h>
 #include <errno.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
-#include <sys/wait.h>
+#include <sys/uio.h>
+#include "index.h"
+#include "search.h"
 
-bool starts_with(const char *str, const char *prefix){
-    if (strlen(prefix) > strlen(str)){
-        return false;
-    }else{
-        return !strncmp(str, prefix, strlen(prefix));
+// Once the collected paths use more memory than this, they are sorted and
+// spilled to a temporary file, and the files are merged at the end.
+#define MEMORY_BUDGET (256 * 1024 * 1024)
+#define CHUNK_SIZE    (1024 * 1024)
+#define OUTBUF_SIZE   65536
+#define MAX_IOVECS    1024
+
+typedef struct chunk {
+    struct chunk *next;
+    size_t used;
+    char data[CHUNK_SIZE];
+} chunk;
+
+typedef struct path_ref {
+    const char *path;
+    size_t len;
+} path_ref;
+
+/**
+ * Matched paths are copied into a list of large chunks rather than malloc'ed
+ * one by one, so collecting and releasing them is cheap. Each path is stored
+ * with its trailing new line, so it can be written straight from the chunk.
+ */
+typedef struct collector {
+    chunk *chunks;
+    path_ref *paths;
+    size_t count;
+    size_t cap;
+    size_t bytes;
+    FILE **runs;            // sorted, NUL separated spill files
+    size_t num_runs;
+} collector;
+
+/* One input of the final merge: a spill file or the in-memory paths. */
+typedef struct merge_source {
+    FILE *file;
+    char *line;
+    size_t line_cap;
+    const path_ref *next;
+    const path_ref *end;
+    const char *path;
+    size_t len;
+} merge_source;
+
+char outbuf[OUTBUF_SIZE];
+size_t outbuf_len = 0;
+long total = 0;
+
+void *xmalloc(size_t size){
+    void *ptr = malloc(size);
+    if (ptr == NULL){
+        fprintf(stderr, "Error: malloc() failed. %s.\n", strerror(errno));
+        exit(EXIT_FAILURE);
     }
+    return ptr;
 }
 
-int main(int argc, char *argv[]){
-    int pfind_to_sort[2], sort_to_parent[2];
-    
-    if(pipe(pfind_to_sort) < 0){
-        fprintf(stderr, "Error: pipe() failed. %s\n", strerror(errno));
-        return EXIT_FAILURE;
+void flush_output(){
+    size_t written = 0;
+    while (written < outbuf_len){
+        ssize_t n = write(STDOUT_FILENO, outbuf + written, outbuf_len - written);
+        if (n < 0){
+            if (errno == EINTR){
+                continue;
+            }
+            fprintf(stderr, "Error: write() failed. %s\n", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        written += n;
     }
-    if (pipe(sort_to_parent) < 0){
-        fprintf(stderr, "Error: pipe() failed. %s\n", strerror(errno));
-        return EXIT_FAILURE;
+    outbuf_len = 0;
+}
+
+/**
+ * Appends a path and a new line to the output buffer, which is written out
+ * in OUTBUF_SIZE pieces rather than one write per line.
+ */
+void emit(const char *path, size_t len){
+    if (outbuf_len + len + 1 > OUTBUF_SIZE){
+        flush_output();
     }
+    memcpy(outbuf + outbuf_len, path, len);
+    outbuf_len += len;
+    outbuf[outbuf_len++] = '\n';
+    ++total;
+}
 
-    pid_t pid[2];
-    if ((pid[0] = fork()) < 0){
-        fprintf(stderr, "Error: fork() failed. %s.\n", strerror(errno));
-        return EXIT_FAILURE;
-    
-    }
-    else if ((pid[0] == 0)){
-            close(pfind_to_sort[0]); close(sort_to_parent[0]); close(sort_to_parent[1]);
-            
-            if(dup2(pfind_to_sort[1], STDOUT_FILENO) < 0){
-                fprintf(stderr, "Error: dup2() failed. %s\n", strerror(errno));
-                return EXIT_FAILURE;
-            }
-            
-            if(execv("pfind", argv) < 0){
-                fprintf(stderr, "Error: pfind failed.\n");
-                return EXIT_FAILURE;
-            }
-    
+/**
+ * Compares paths in byte order. Paths in the chunks are not NUL terminated.
+ */
+int compare_paths(const char *a, size_t a_len, const char *b, size_t b_len){
+    int result = memcmp(a, b, a_len < b_len ? a_len : b_len);
+    if (result != 0){
+        return result;
     }
+    return a_len < b_len ? -1 : a_len > b_len;
+}
 
-    if ((pid[1] = fork()) < 0){
-            fprintf(stderr, "Error: fork() failed. %s.\n", strerror(errno));
-            return EXIT_FAILURE;
-    
-    }
-    else if ((pid[1] == 0)){
-            close(pfind_to_sort[1]); close(sort_to_parent[0]);
-            
-            if(dup2(pfind_to_sort[0], STDIN_FILENO) < 0){
-                fprintf(stderr, "Error: dup2() failed. %s\n", strerror(errno));
-                return EXIT_FAILURE;
-            }
-            
-            if(dup2(sort_to_parent[1], STDOUT_FILENO) < 0){
-                fprintf(stderr, "Error: dup2() failed. %s\n", strerror(errno));
-                return EXIT_FAILURE;
-            }
-            
-            if(execlp("sort", "sort", NULL) < 0){
-                fprintf(stderr, "Error: sort failed.\n");
-                return EXIT_FAILURE;
-            }
-    
+int path_cmp(const void *a, const void *b){
+    const path_ref *x = (const path_ref *)a;
+    const path_ref *y = (const path_ref *)b;
+    return compare_paths(x->path, x->len, y->path, y->len);
+}
+
+/**
+ * Releases every chunk but the first, which is kept for the next run.
+ */
+void reset_collector(collector *c){
+    if (c->chunks == NULL){
+        return;
+    }
+    chunk *ch = c->chunks->next;
+    while (ch != NULL){
+        chunk *next = ch->next;
+        free(ch);
+        ch = next;
     }
+    c->chunks->next = NULL;
+    c->chunks->used = 0;
+    c->count = 0;
+    c->bytes = 0;
+}
 
-    close(pfind_to_sort[0]); close(pfind_to_sort[1]); close(sort_to_parent[1]);
-    if(dup2(sort_to_parent[0], STDIN_FILENO) < 0){
-        fprintf(stderr, "Error: dup2() failed. %s\n", strerror(errno));
-        return EXIT_FAILURE;
+/**
+ * Sorts the paths collected so far and writes them to a temporary file.
+ */
+void spill_run(collector *c){
+    qsort(c->paths, c->count, sizeof(path_ref), path_cmp);
+    FILE *run = tmpfile();
+    if (run == NULL){
+        fprintf(stderr, "Error: Cannot create temporary file. %s.\n",
+                strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < c->count; i++){
+        fwrite(c->paths[i].path, 1, c->paths[i].len, run);
+        fputc('\0', run);
+    }
+    if (fflush(run) != 0 || fseek(run, 0, SEEK_SET) != 0){
+        fprintf(stderr, "Error: Cannot write temporary file. %s.\n",
+                strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    c->runs = realloc(c->runs, (c->num_runs + 1) * sizeof(FILE *));
+    if (c->runs == NULL){
+        fprintf(stderr, "Error: realloc() failed. %s.\n", strerror(errno));
+        exit(EXIT_FAILURE);
     }
+    c->runs[c->num_runs++] = run;
+    reset_collector(c);
+}
 
-    char buf[4096];
-    int bytes_read = 0;
-    int count = 0;
-    bool error = false;
+/**
+ * Match callback for navigate_sorted(), which already reports paths in order.
+ */
+void emit_match(const char *path, size_t len, void *arg){
+    emit(path, len);
+}
 
-    while((bytes_read = read(STDIN_FILENO,buf, sizeof(buf)))>0){
-        for(int i = 0; i <= bytes_read; ++i){
-            if(write(STDOUT_FILENO, buf+i, 1) < 0){
-                fprintf(stderr, "Error: write() failed. %s\n", strerror(errno));
-                return EXIT_FAILURE;
-            }
-            if(*(buf+i) == '\n'){
-                ++count;
-            }
-            
-        } 
+void collect(const char *path, size_t len, void *arg){
+    collector *c = (collector *)arg;
+    if (c->chunks == NULL || c->chunks->used + len + 1 > CHUNK_SIZE){
+        chunk *ch = xmalloc(sizeof(chunk));
+        ch->next = c->chunks;
+        ch->used = 0;
+        c->chunks = ch;
     }
-    if(bytes_read < 0){
-        fprintf(stderr, "Error: read() failed. %s\n", strerror(errno));
-        return EXIT_FAILURE;
+    char *copy = c->chunks->data + c->chunks->used;
+    memcpy(copy, path, len);
+    copy[len] = '\n';
+    c->chunks->used += len + 1;
+
+    if (c->count == c->cap){
+        c->cap = c->cap == 0 ? 4096 : c->cap * 2;
+        c->paths = realloc(c->paths, c->cap * sizeof(path_ref));
+        if (c->paths == NULL){
+            fprintf(stderr, "Error: realloc() failed. %s.\n", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
     }
-    if (starts_with(buf, "Usage:")){
-        error = true;
+    c->paths[c->count].path = copy;
+    c->paths[c->count++].len = len;
+    c->bytes += len + 1 + sizeof(path_ref);
+    if (c->bytes > MEMORY_BUDGET){
+        spill_run(c);
     }
+}
 
-    int status;
-    for(int i = 0; i< 2; ++i){
-        pid_t wpid = waitpid(pid[i], &status, 0);
-        if(WEXITSTATUS(status) == EXIT_FAILURE){
-            error = true;
+bool advance(merge_source *src){
+    if (src->file != NULL){
+        ssize_t n = getdelim(&src->line, &src->line_cap, '\0', src->file);
+        if (n <= 0){
+            return false;
         }
-        if (wpid == -1){
-            if(i == 0){
-                fprintf(stderr, "Error: waitpid() failed for pfind.\n");
+        src->path = src->line;
+        src->len = n - 1;
+        return true;
+    }
+    if (src->next == src->end){
+        return false;
+    }
+    src->path = src->next->path;
+    src->len = src->next->len;
+    src->next++;
+    return true;
+}
+
+void sift_down(merge_source **heap, size_t n, size_t i){
+    while (true){
+        size_t min = i, l = 2 * i + 1, r = 2 * i + 2;
+        if (l < n && compare_paths(heap[l]->path, heap[l]->len,
+                                   heap[min]->path, heap[min]->len) < 0){
+            min = l;
+        }
+        if (r < n && compare_paths(heap[r]->path, heap[r]->len,
+                                   heap[min]->path, heap[min]->len) < 0){
+            min = r;
+        }
+        if (min == i){
+            return;
+        }
+        merge_source *tmp = heap[i];
+        heap[i] = heap[min];
+        heap[min] = tmp;
+        i = min;
+    }
+}
+
+/**
+ * Writes the sorted paths directly from the chunks with writev, up to
+ * MAX_IOVECS lines per call, instead of copying them into outbuf first.
+ * Paths that happen to sit next to each other in a chunk share an iovec.
+ */
+void write_paths(const path_ref *paths, size_t count){
+    struct iovec iov[MAX_IOVECS];
+    size_t i = 0;
+    while (i < count){
+        int n = 0;
+        for (; i < count && n < MAX_IOVECS; i++){
+            if (n > 0 && (const char *)iov[n - 1].iov_base +
+                    iov[n - 1].iov_len == paths[i].path){
+                iov[n - 1].iov_len += paths[i].len + 1;
             }else{
-                fprintf(stderr, "Error: waitpid() failed for sort.\n");
+                iov[n].iov_base = (void *)paths[i].path;
+                iov[n++].iov_len = paths[i].len + 1;
             }
-            return EXIT_FAILURE;
         }
-        if (!WIFEXITED(status) || (WEXITSTATUS(status) == EXIT_FAILURE)){
+        struct iovec *next = iov;
+        while (n > 0){
+            ssize_t written = writev(STDOUT_FILENO, next, n);
+            if (written < 0){
+                if (errno == EINTR){
+                    continue;
+                }
+                fprintf(stderr, "Error: write() failed. %s\n", strerror(errno));
+                exit(EXIT_FAILURE);
+            }
+            // Skip what was written, which may end in the middle of an iovec.
+            while (n > 0 && (size_t)written >= next->iov_len){
+                written -= next->iov_len;
+                next++;
+                n--;
+            }
+            if (n > 0){
+                next->iov_base = (char *)next->iov_base + written;
+                next->iov_len -= written;
+            }
+        }
+    }
+    total += count;
+}
+
+/**
+ * Writes the collected paths in sorted order, merging the spill files with
+ * the paths still in memory if the budget was exceeded.
+ */
+void write_sorted(collector *c){
+    qsort(c->paths, c->count, sizeof(path_ref), path_cmp);
+    if (c->num_runs == 0){
+        write_paths(c->paths, c->count);
+        return;
+    }
+
+    size_t num_sources = c->num_runs + 1;
+    merge_source *sources = xmalloc(num_sources * sizeof(merge_source));
+    merge_source **heap = xmalloc(num_sources * sizeof(merge_source *));
+    memset(sources, 0, num_sources * sizeof(merge_source));
+    size_t n = 0;
+    for (size_t i = 0; i < num_sources; i++){
+        if (i < c->num_runs){
+            sources[i].file = c->runs[i];
+        }else{
+            sources[i].next = c->paths;
+            sources[i].end = c->paths + c->count;
+        }
+        if (advance(&sources[i])){
+            heap[n++] = &sources[i];
+        }
+    }
+    for (size_t i = n / 2; i-- > 0;){
+        sift_down(heap, n, i);
+    }
+    while (n > 0){
+        emit(heap[0]->path, heap[0]->len);
+        if (!advance(heap[0])){
+            heap[0] = heap[--n];
+        }
+        sift_down(heap, n, 0);
+    }
+    for (size_t i = 0; i < c->num_runs; i++){
+        free(sources[i].line);
+        fclose(c->runs[i]);
+    }
+    free(sources);
+    free(heap);
+}
+
+void free_collector(collector *c){
+    reset_collector(c);
+    free(c->chunks);
+    free(c->paths);
+    free(c->runs);
+}
+
+int main(int argc, char *argv[]){
+    search_opts opts;
+    int parsed = parse_search_args(argc, argv, &opts);
+    if (parsed != PARSE_OK){
+        return parsed == PARSE_HELP ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    if (opts.build_index != NULL){
+        fprintf(stderr, "Error: Option -b is not supported by spfind.\n");
+        return EXIT_FAILURE;
+    }
+
+    // A live walk sorts each directory as it goes and streams its output.
+    // The index stores entries in readdir() order, so its matches are
+    // collected and sorted as a whole.
+    if (opts.query_index == NULL){
+        if (navigate_sorted(opts.directory, &opts.pred, emit_match,
+                            NULL) == EXIT_FAILURE){
             return EXIT_FAILURE;
         }
+        flush_output();
+        printf("Total matches: %ld\n", total);
+        return EXIT_SUCCESS;
     }
-    if(!error){
-        printf("Total matches: %d\n",count);
+
+    collector c;
+    memset(&c, 0, sizeof(collector));
+    if (index_query(opts.query_index, opts.directory, &opts.pred, collect,
+                    &c) == EXIT_FAILURE){
+        free_collector(&c);
+        return EXIT_FAILURE;
     }
 
+    write_sorted(&c);
+    flush_output();
+    free_collector(&c);
+    printf("Total matches: %ld\n", total);
     return EXIT_SUCCESS;
-}
\ No newline at end of file
+}